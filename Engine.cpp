@@ -2,22 +2,43 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <algorithm>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <csignal>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
 #include <unordered_map>
+#include <cctype>
+#include <climits>
+#include <stdexcept>
 
-using namespace std;
+// SSE2 and AVX2 are used to scan values files on x86, other targets use the scalar scanner
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
-// Operator structure to hold operation details
-struct Operator {
-    char type;
-    string firstVar;
-    string secondVar;
-    string result;
-};
+using namespace std;
 
 // Pipe structure to facilitate main pipe implementation
 struct Pipe {
@@ -52,364 +73,3020 @@ struct Pipe {
     }
 };
 
-// GLOBAL VARIABLES //
-vector<string> inputVar;
-vector<string> internalVar;
-unordered_map<string, vector<Operator> > operationsMap;
-unordered_map<string, int> variableValues;
-vector<string> writeVariables;
+// Run options structure to hold settings taken from the command line
+struct RunOptions {
+    size_t maxProcs = 0;           // children allowed in flight at once, 0 picks a default
+    bool batch = false;            // evaluate every line of the values file
+    size_t checkpointEvery = 1000; // batch rows between checkpoints
+    bool resume = false;           // continue a batch run from its last checkpoint
+    size_t cacheBytes = 0;         // memory cap of the result cache, 0 disables it
+    string cacheFile;              // where the result cache is kept between runs
+    size_t parseThreads = 0;       // graph parser threads, 0 uses every core
+    string metricsFile;            // Prometheus metrics are written here at exit
+    string metricsSocket;          // Unix socket serving Prometheus metrics while running
+    bool watch = false;            // keep running and reload the graph file when it changes
+    size_t shards = 1;             // batch row ranges evaluated by separate processes
+    bool memoryReport = false;     // print the graph memory use after parsing
+};
 
+// Running child structure to track a forked child until it is reaped
+struct RunningChild {
+    uint32_t node;                           // graph node of the variable it computes
+    int readEnd;                             // pipe read end, -1 when no result is read back
+    chrono::steady_clock::time_point started;
+};
 
-/* 
-    * The cleanParser() function removes leading and trailing 
-    characters such as commas, semicolon, spaces
+// Checkpoint structure to record how far a batch run has committed
+struct Checkpoint {
+    long long inputOffset = 0;  // bytes of the values file already evaluated
+    long long outputOffset = 0; // bytes of the output file written for those rows
+    size_t rows = 0;            // rows evaluated so far
+    uint64_t graph = 0;         // identity of the graph the rows were evaluated with
+    uint64_t valuesHash = 0;    // hash of the values file up to inputOffset
+};
 
-    * Variable string parser is the given string to clean
+// Smallest block a GraphArena allocates when it runs out of room
+const size_t ARENA_BLOCK_BYTES = 64 << 10;
+
+// Flags of an interned name in CompactGraph::nameFlags
+const uint8_t NAME_INPUT = 1;
+const uint8_t NAME_INTERNAL = 2;
+
+// Node id of a name that no operation computes
+const uint32_t NO_NODE = UINT32_MAX;
+
+// Graph arena structure to hand out the memory of one graph from a few large blocks
+struct GraphArena {
+    vector<unique_ptr<char[]> > blocks;
+    size_t blockSize = 0;
+    size_t blockUsed = 0;
+    size_t reserved = 0; // bytes of every block together
+
+    // Makes the next block at least bytes large, so a graph of known size takes one block
+    void reserve(size_t bytes) {
+        blocks.emplace_back(new char[bytes]);
+        blockSize = bytes;
+        blockUsed = 0;
+        reserved += bytes;
+    }
 
-    * Return variable is the clean string
+    void* allocate(size_t bytes, size_t alignment) {
+        size_t offset = (blockUsed + alignment - 1) & ~(alignment - 1);
+        if (blocks.empty() || offset + bytes > blockSize) {
+            reserve(max(bytes, ARENA_BLOCK_BYTES));
+            offset = 0;
+        }
+        blockUsed = offset + bytes;
+        return blocks.back().get() + offset;
+    }
 
-*/
-string cleanParser(string parser) {
+    template <typename T>
+    T* allocateArray(size_t count) {
+        return static_cast<T*>(allocate(max<size_t>(count, 1) * sizeof(T), alignof(T)));
+    }
+};
 
-    while (!parser.empty() && (parser.front() == ',' || parser.front() == ';' || parser.front() == ' ')) {
-        parser.erase(parser.begin());
+// Compact graph structure to hold a parsed graph as integer ids and compressed sparse rows
+struct CompactGraph {
+    GraphArena arena; // owns every array below, the whole graph is released with it
+
+    // Interned names, name i is names[nameStart[i]] up to names[nameStart[i + 1]]
+    uint32_t nameCount = 0;
+    const char* names = NULL;
+    const uint32_t* nameStart = NULL;
+    const uint8_t* nameFlags = NULL; // NAME_INPUT and NAME_INTERNAL
+    const uint32_t* nameNode = NULL; // node computing the name, NO_NODE when none does
+
+    // input_var, internal_var and write(...) lists as name ids, in file order
+    uint32_t inputCount = 0;
+    const uint32_t* inputs = NULL;
+    uint32_t internalCount = 0;
+    const uint32_t* internals = NULL;
+    uint32_t writeCount = 0;
+    const uint32_t* writes = NULL;
+
+    // Result variables in sorted name order, the operations of node i are opStart[i] up to opStart[i + 1]
+    uint32_t nodeCount = 0;
+    const uint32_t* nodeName = NULL;
+    const uint32_t* opStart = NULL;
+    const char* opType = NULL;
+    const uint32_t* opOperand = NULL; // name id each operation reads
+
+    string name(uint32_t id) const {
+        return string(nameView(id));
     }
-    while (!parser.empty() && (parser.back() == ',' || parser.back() == ';' || parser.back() == ' ')) {
-        parser.pop_back();
+
+    // View into the names array, valid as long as the graph
+    string_view nameView(uint32_t id) const {
+        return string_view(names + nameStart[id], nameStart[id + 1] - nameStart[id]);
     }
 
-    return parser;
-}
+    bool isInput(uint32_t id) const {
+        return (nameFlags[id] & NAME_INPUT) != 0;
+    }
+};
 
+// Graph builder structure to intern names and collect operations until the compact graph is laid out
+struct GraphBuilder {
+    // Names are views into the text of the graph file, which outlives the builder
+    unordered_map<string_view, uint32_t> ids;
+    vector<string_view> names;
+    size_t nameBytes = 0;
+    vector<uint32_t> inputs;
+    vector<uint32_t> internals;
+    vector<uint32_t> writes;
+    vector<uint32_t> opResult; // operations in file order
+    vector<char> opType;
+    vector<uint32_t> opOperand;
+    vector<uint32_t> nodeName; // result names in sorted name order, filled in by mergeChunks()
+
+    uint32_t intern(string_view name) {
+        auto found = ids.find(name);
+        if (found != ids.end()) {
+            return found->second;
+        }
+        uint32_t id = names.size();
+        names.push_back(name);
+        nameBytes += name.size();
+        ids.emplace(name, id);
+        return id;
+    }
 
-/* 
-    * The parseInput() function parses the input file to extract variables and operations for graph-based computation
+    void addOperation(uint32_t result, char type, uint32_t operand) {
+        opResult.push_back(result);
+        opType.push_back(type);
+        opOperand.push_back(operand);
+    }
+};
+
+// Parsed chunk structure to hold what one parser thread found in its part of the graph file
+struct ParsedChunk {
+    GraphBuilder builder;  // name ids are local to the chunk until it is merged
+    bool sawWrite = false; // statements after write(...) are ignored
+    string errors;         // printed when the chunk is merged
+    vector<vector<uint32_t> > partitions; // ids of the chunk's names by name hash, see mergeChunks()
+    vector<bool> isResult;                // names that are the result of an operation
+};
+
+// Execution plan structure to schedule each node of the graph once its dependencies are done
+struct ExecutionPlan {
+    vector<uint32_t> dependentStart; // nodes waiting on node i are dependents[dependentStart[i]] up to dependentStart[i + 1]
+    vector<uint32_t> dependents;
+    vector<uint32_t> pendingDeps;    // unfinished dependencies per node
+    vector<bool> hasPipe;            // only internal variables report a result back
+    uint64_t identity = 0;           // hash of the parsed graph, keys the result cache
+};
+
+// Cache entry structure to hold the write(...) results of one input tuple
+struct CacheEntry {
+    uint64_t graph;      // identity of the graph the results belong to
+    vector<int> inputs;  // input values in input_var order
+    vector<int> results; // computed write(...) values in write order
+};
 
-    * Populates global structures with input variables, internal variables, and operations
+/* 
+    * The hashBytes() function hashes a block of memory with 64-bit FNV-1a
 
-    * Variable string file_name contains the given dataflow graph
+    * Variable uint64_t seed lets several blocks be chained into one hash
 
 */
-void parseInput(string& file_name) {
-    ifstream input(file_name);
-    string line;    
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ULL) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        seed = (seed ^ bytes[i]) * 1099511628211ULL;
+    }
+    return seed;
+}
 
-    if (!input.is_open()) {
-        throw runtime_error("Cannot open file: " + file_name);
+// Result cache structure to answer repeated input tuples without running the graph
+struct ResultCache {
+    size_t capacity = 0; // memory cap in bytes, 0 means disabled
+    size_t used = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+
+    // Entries are kept most recently used first, the index maps a tuple hash to its entries
+    list<CacheEntry> entries;
+    unordered_multimap<uint64_t, list<CacheEntry>::iterator> index;
+
+    static uint64_t key(uint64_t graph, const vector<int>& inputs) {
+        return hashBytes(inputs.data(), inputs.size() * sizeof(int), hashBytes(&graph, sizeof(graph)));
     }
 
-    while (getline(input, line, ';')) {
-        istringstream iss(line);
-        string parser;
-        iss >> parser;
-
-        if (parser == "input_var") {
-            string varsLine;
-            getline(iss, varsLine);
-            istringstream varStream(varsLine);
-            string var;
-            while (getline(varStream, var, ',')) {
-                var = cleanParser(var);
-                if (!var.empty()) {
-                    inputVar.push_back(var);
-                }
+    // Approximate memory held by one entry, list and index nodes included
+    static size_t entryBytes(const CacheEntry& entry) {
+        return sizeof(CacheEntry) + 2 * sizeof(void*)
+             + sizeof(pair<uint64_t, list<CacheEntry>::iterator>) + 2 * sizeof(void*)
+             + (entry.inputs.size() + entry.results.size()) * sizeof(int);
+    }
+
+    const CacheEntry* find(uint64_t graph, const vector<int>& inputs) {
+        auto range = index.equal_range(key(graph, inputs));
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second->graph == graph && it->second->inputs == inputs) {
+                entries.splice(entries.begin(), entries, it->second);
+                hits++;
+                return &entries.front();
             }
         }
-        else if (parser == "internal_var") {
-            string varsLine;
-            getline(iss, varsLine);
-            istringstream varStream(varsLine);
-            string var;
-            while (getline(varStream, var, ',')) {
-                var = cleanParser(var);
-                if (!var.empty()) {
-                    internalVar.push_back(var);
+        misses++;
+        return NULL;
+    }
+
+    void insert(CacheEntry entry) {
+        size_t bytes = entryBytes(entry);
+        if (bytes > capacity) {
+            return;
+        }
+
+        uint64_t hash = key(entry.graph, entry.inputs);
+        entries.push_front(move(entry));
+        index.emplace(hash, entries.begin());
+        used += bytes;
+
+        // Evict least recently used entries until the cache fits its cap again
+        while (used > capacity) {
+            CacheEntry& last = entries.back();
+            auto range = index.equal_range(key(last.graph, last.inputs));
+            for (auto it = range.first; it != range.second; ++it) {
+                if (&*it->second == &last) {
+                    index.erase(it);
+                    break;
                 }
             }
+            used -= entryBytes(last);
+            entries.pop_back();
         }
+    }
+};
 
-        else if (parser.find("write", 0) == 0) {
-            // We use '(' bracket to know where to start
-            int startPos = line.find('(');
+// Descriptors kept aside for stdio, the input files and the output file
+const size_t RESERVED_FDS = 16;
+
+// Graph files smaller than this are parsed on a single thread
+const size_t PARALLEL_PARSE_BYTES = 1 << 20;
+
+// Memory cap of the result cache when only --cache-file is given
+const size_t DEFAULT_CACHE_BYTES = 64 << 20;
+
+// Exit status of a child that divided by zero, so the parent can count it
+const int EXIT_DIVISION_BY_ZERO = 3;
+
+// Counters exported as Prometheus metrics
+enum MetricCounter {
+    GRAPHS_PARSED,
+    STATEMENTS_PARSED,
+    ROWS_EVALUATED,
+    NODES_EVALUATED,
+    FORKS,
+    PIPE_BYTES,
+    DIVISION_BY_ZERO,
+    CHILD_FAILURES,
+    CACHE_HITS,
+    CACHE_MISSES,
+    GRAPH_RELOADS,
+    WORKER_BUSY_NS,     // time children were running
+    WORKER_CAPACITY_NS, // time children could have been running, max procs times execute time
+    COUNTER_COUNT
+};
 
-            // We use ')' bracket to know where to end
-            int endPos = line.find(')');
+// Phases whose latency is exported as a histogram
+enum Phase {
+    PHASE_PARSE,
+    PHASE_INIT,
+    PHASE_EXECUTE,
+    PHASE_OUTPUT,
+    PHASE_COUNT
+};
 
-            if (startPos != string::npos && endPos != string::npos && endPos > startPos) {
-                string varsStr = line.substr(startPos + 1, endPos - startPos - 1);
+// Upper bounds in seconds of the latency histogram buckets, +Inf is implied
+const double LATENCY_BUCKETS[] = {0.0001, 0.001, 0.01, 0.1, 1, 10, 100};
+const size_t LATENCY_BUCKET_COUNT = sizeof(LATENCY_BUCKETS) / sizeof(LATENCY_BUCKETS[0]);
 
-                istringstream varsStream(varsStr);
-                string var;
-                while (getline(varsStream, var, ',')) {
-                    var = cleanParser(var);
-                    if (!var.empty()) {
-                        writeVariables.push_back(var);
-                    }
-                }
-                
-            } else {
-                cerr << "Error: Parsing 'write' variables failed. Check syntax." << endl;
-            }
-            break;
-        }
+// Metric snapshot structure to hold a plain copy of every metric
+struct MetricSnapshot {
+    uint64_t counters[COUNTER_COUNT] = {};
+    uint64_t buckets[PHASE_COUNT][LATENCY_BUCKET_COUNT + 1] = {}; // per bucket, last one is +Inf
+    uint64_t phaseNs[PHASE_COUNT] = {};
+};
 
-        else if (!parser.empty() && parser != "write") {
-            Operator op;
-            string arrow, targetVar;
+// Metric slot structure, each thread owns one and is the only one writing to it
+struct MetricSlot {
+    atomic<uint64_t> counters[COUNTER_COUNT];
+    atomic<uint64_t> buckets[PHASE_COUNT][LATENCY_BUCKET_COUNT + 1];
+    atomic<uint64_t> phaseNs[PHASE_COUNT];
+};
 
-            // We check if the line starts with an operation
-            if (parser == "+" || parser == "-" || parser == "*" || parser == "/") {
+// Shard report structure sent back by a shard process when it is done
+struct ShardReport {
+    MetricSnapshot metrics; // metrics recorded by the shard only
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint64_t rows;
+};
 
-                // Operation type
-                op.type = parser[0]; 
+// GLOBAL VARIABLES //
+RunOptions options;
+CompactGraph graph;
+vector<int> variableValues; // by name id
+ResultCache resultCache;
 
-                // First Variable
-                iss >> targetVar;
+// Set by SIGINT and SIGTERM to end --watch
+volatile sig_atomic_t stopRequested = 0;
 
-                // Then, expect to find the "->" symbol
-                // Followed by the destination variable
-                iss >> arrow >> op.result;
+// Slots of every running thread that recorded a metric, and the totals of threads that ended
+mutex metricsMutex;
+vector<MetricSlot*> metricSlots;
+MetricSnapshot retiredMetrics;
 
-                if (arrow != "->" || op.result.empty()) {
-                    cerr << "Error: Parsing unary operation failed." << endl;
-                    continue;
-                }
+// The main thread keeps its slot until exit, forked children exit from a copy of it
+const thread::id mainThread = this_thread::get_id();
 
-                op.firstVar = cleanParser(targetVar);
-            }else {
-                
-                // This section aims to remove outliers in the data
-                string restOfLine;
-                getline(iss, restOfLine);
-                istringstream restStream(restOfLine);
 
-                // Attempt to parse the arrow and result again using the new stream
-                restStream >> arrow >> op.result;
+/* 
+    * The addSlot() function adds the values of a metric slot to a snapshot
 
-                if (arrow != "->" || op.result.empty()) {
-                    cerr << "Error: Expected '->' but found '" << arrow << "'" << endl;
-                    continue;
-                }
+*/
+void addSlot(MetricSnapshot& snapshot, const MetricSlot& slot) {
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        snapshot.counters[i] += slot.counters[i].load(memory_order_relaxed);
+    }
+    for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+        for (size_t bucket = 0; bucket <= LATENCY_BUCKET_COUNT; bucket++) {
+            snapshot.buckets[phase][bucket] += slot.buckets[phase][bucket].load(memory_order_relaxed);
+        }
+        snapshot.phaseNs[phase] += slot.phaseNs[phase].load(memory_order_relaxed);
+    }
+}
+
+// Slot owner structure to fold the slot of a thread into retiredMetrics when the thread ends
+struct SlotOwner {
+    MetricSlot* slot = NULL;
+
+    ~SlotOwner() {
+        lock_guard<mutex> lock(metricsMutex);
+        addSlot(retiredMetrics, *slot);
+        metricSlots.erase(find(metricSlots.begin(), metricSlots.end(), slot));
+        delete slot;
+    }
+};
 
-                // If we reach this section, parsing was successful
-                op.firstVar = cleanParser(parser);
-                op.type = '\0'; // detects null operation
-                op.result = cleanParser(op.result);
-            }
 
-            op.result = cleanParser(op.result);
+/* 
+    * The localMetrics() function returns the metric slot of the calling thread
 
-            // After parsing the operation line, add the operation to the operationsMap
-            operationsMap[op.result].push_back(op);
+    * The slot is registered on first use, after that recording a metric takes no lock.
+    Parser threads are started again on every reload, so the slot of any thread but the
+    main one is released when the thread ends and its values are kept in retiredMetrics
 
-            // Debugging print for the constructed operation
-            cout << "Constructed operation: " << (op.type != '\0' ? string(1, op.type) + " " : "") << op.firstVar << " -> " << op.result << endl;
+*/
+MetricSlot& localMetrics() {
+    thread_local MetricSlot* slot = NULL;
+    if (slot == NULL) {
+        slot = new MetricSlot();
+        {
+            lock_guard<mutex> lock(metricsMutex);
+            metricSlots.push_back(slot);
+        }
+        if (this_thread::get_id() != mainThread) {
+            thread_local SlotOwner owner;
+            owner.slot = slot;
         }
     }
+    return *slot;
+}
 
-    input.close();
+
+/* 
+    * The addMetric() function adds to a counter of the calling thread
+
+    * Only the owning thread writes its slot, so a relaxed load and store is enough
+
+*/
+void addMetric(MetricCounter counter, uint64_t amount = 1) {
+    atomic<uint64_t>& value = localMetrics().counters[counter];
+    value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
 }
 
 
 /* 
-    * The initializeVars() function initializes given values needed to assign to the previous graph
+    * The observePhase() function records how long one run of a phase took
 
-    * Reads in values from a file using IO, and assigns them to corresponding variables
+*/
+void observePhase(Phase phase, uint64_t nanoseconds) {
+    MetricSlot& slot = localMetrics();
+    size_t bucket = 0;
+    while (bucket < LATENCY_BUCKET_COUNT && nanoseconds > LATENCY_BUCKETS[bucket] * 1e9) {
+        bucket++;
+    }
 
-    * Variable string initialValue contains the given initialized values in a valid .txt file
+    atomic<uint64_t>& count = slot.buckets[phase][bucket];
+    count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic<uint64_t>& total = slot.phaseNs[phase];
+    total.store(total.load(memory_order_relaxed) + nanoseconds, memory_order_relaxed);
+}
+
+// Phase timer structure to record the latency of the scope it lives in
+struct PhaseTimer {
+    Phase phase;
+    chrono::steady_clock::time_point start;
+
+    explicit PhaseTimer(Phase timedPhase) : phase(timedPhase), start(chrono::steady_clock::now()) {}
+
+    ~PhaseTimer() {
+        observePhase(phase, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+};
+
+
+/* 
+    * The cleanParser() function removes leading and trailing 
+    characters such as commas, semicolon, spaces
+
+    * Variable string parser is the given string to clean
+
+    * Return variable is the clean string
 
 */
-void initializeVars(const string& initialValue) {
-    ifstream file(initialValue);
-    if (!file.is_open()) {
-        throw runtime_error("Cannot open file: " + initialValue);
+string cleanParser(string parser) {
+
+    while (!parser.empty() && (parser.front() == ',' || parser.front() == ';' || parser.front() == ' ')) {
+        parser.erase(parser.begin());
+    }
+    while (!parser.empty() && (parser.back() == ',' || parser.back() == ';' || parser.back() == ' ')) {
+        parser.pop_back();
     }
 
-    string line;
-    if (getline(file, line)) {
-        istringstream iss(line);
-        string value;
-        int i = 0;
-
-        while (getline(iss, value, ',')) {
-            string cleanedValue = cleanParser(value);
-            
-            // Ensure we don't read more values than provided
-            if (i >= inputVar.size()) {
-                break;
-            }
+    return parser;
+}
 
-            string currentVarName = inputVar[i];
-            variableValues[currentVarName] = stoi(cleanedValue);
-            i++;
-        }
-    } else {
-        cerr << "Error: Could not read the initial values line." << endl;
+
+/* 
+    * The cleanName() function is cleanParser() for a view into the graph file
+
+    * Removes leading and trailing commas, semicolons and spaces without copying
+
+*/
+string_view cleanName(string_view parser) {
+    while (!parser.empty() && (parser.front() == ',' || parser.front() == ';' || parser.front() == ' ')) {
+        parser.remove_prefix(1);
     }
-    file.close();
+    while (!parser.empty() && (parser.back() == ',' || parser.back() == ';' || parser.back() == ' ')) {
+        parser.remove_suffix(1);
+    }
+    return parser;
 }
 
 
 /* 
-     * Main function to orchestrate the execution of data flow operations.
+    * The nextToken() function reads the next whitespace separated word, like operator>> does
 
-    * Reads input specifications, initializes variables, creates pipes, and forks child processes to execute operations.
+    * Variable size_t pos is where reading starts and is moved past the word
 
-    * Results are read from pipes and written to an output file.
+    * Return variable is the word, empty at the end of the text
 
-    * Values are given on the command line, values may contain important input files or output file name
+*/
+string_view nextToken(string_view text, size_t& pos) {
+    while (pos < text.size() && isspace((unsigned char)text[pos])) {
+        pos++;
+    }
+    size_t start = pos;
+    while (pos < text.size() && !isspace((unsigned char)text[pos])) {
+        pos++;
+    }
+    return text.substr(start, pos - start);
+}
+
+
+/* 
+    * The restOfLine() function returns the text from pos up to the next newline, like getline() does
 
 */
-int main(int argc, char* argv[]) {
-    if (argc < 4) {
-        cerr << "Usage: " << argv[0] << " [input-graph-file] [initial-values-file] [output-file-name]\n";
-        return 1;
+string_view restOfLine(string_view text, size_t pos) {
+    size_t newline = text.find('\n', pos);
+    return text.substr(pos, newline == string_view::npos ? string_view::npos : newline - pos);
+}
+
+
+/* 
+    * The internNames() function interns every name of a comma separated list
+
+    * Variable vector ids receives the ids of the names in list order, empty names are skipped
+
+*/
+void internNames(string_view list, GraphBuilder& builder, vector<uint32_t>& ids) {
+    while (true) {
+        size_t comma = list.find(',');
+        string_view var = cleanName(list.substr(0, comma));
+        if (!var.empty()) {
+            ids.push_back(builder.intern(var));
+        }
+        if (comma == string_view::npos) {
+            break;
+        }
+        list.remove_prefix(comma + 1);
     }
+}
 
-    // Extract file paths from arguments.
-    string dataFlow = argv[1], initialValues = argv[2], outputName = argv[3];
 
-    // Sets up operations and dependencies
-    parseInput(dataFlow);
+/* 
+    * The parseStatement() function parses one ';' separated statement of the dataflow graph
 
-    // Assigns initial values such as "x, y, z" with given inputs
-    initializeVars(initialValues);
+    * Adds the declared variables and the operation found in the statement to the chunk,
+    names are interned as views into the statement, so nothing is copied
 
-    // Pipe map to keep track of pipe information
-    unordered_map<string, Pipe> operationPipes;
-    vector<pid_t> childPids;
+    * Variable string_view line is the statement, without its ';'
 
-    // Create pipes for each internal variable
-    for (const auto& var : internalVar) {
-        Pipe pipe;
-        if (pipe.createPipe()) {
-            operationPipes[var] = move(pipe);
+    * Return variable is false after the write(...) statement, which ends the graph
+
+*/
+bool parseStatement(string_view line, ParsedChunk& chunk) {
+    GraphBuilder& builder = chunk.builder;
+    size_t pos = 0;
+    string_view parser = nextToken(line, pos);
+
+    if (parser == "input_var") {
+        internNames(restOfLine(line, pos), builder, builder.inputs);
+    }
+    else if (parser == "internal_var") {
+        internNames(restOfLine(line, pos), builder, builder.internals);
+    }
+
+    else if (parser.substr(0, 5) == "write") {
+        // We use '(' bracket to know where to start
+        size_t startPos = line.find('(');
+
+        // We use ')' bracket to know where to end
+        size_t endPos = line.find(')');
+
+        if (startPos != string_view::npos && endPos != string_view::npos && endPos > startPos) {
+            internNames(line.substr(startPos + 1, endPos - startPos - 1), builder, builder.writes);
         } else {
-            cerr << "Failed to create pipe for " << var << "\n";
-            return EXIT_FAILURE;
+            chunk.errors += "Error: Parsing 'write' variables failed. Check syntax.\n";
         }
+        chunk.sawWrite = true;
+        return false;
     }
 
+    else if (!parser.empty()) {
+        char type;
+        string_view firstVar, arrow, result;
 
+        // We check if the line starts with an operation
+        if (parser == "+" || parser == "-" || parser == "*" || parser == "/") {
 
-    // The vector sorts the operations Map to be read starting from p0
-    vector<string> sortedVars;
-    for (const auto& pair : operationsMap) {
-        sortedVars.push_back(pair.first);
-    }
-    sort(sortedVars.begin(), sortedVars.end());
+            // Operation type
+            type = parser[0];
 
-    // Iterate over sorted variables to fork processes in the correct order
-    for (const auto& var : sortedVars) {
-        cout << "Forking for variable: " << var << "\n";
-        pid_t pid = fork();
+            // First Variable
+            firstVar = nextToken(line, pos);
 
-        if (pid == 0) { // Child process
-            int result = 0;
-            auto& ops = operationsMap[var];
-
-            for (const auto& op : ops) {
-
-                //Reads the first variable to be operated on
-                int operandValue = variableValues[op.firstVar];
-
-                // Compute result based on operation type
-                switch (op.type) {
-                    case '+':
-                        result += operandValue;
-                        break;
-                    case '-':
-                        result -= operandValue;
-                        break;
-                    case '*':
-                        result *= operandValue;
-                        break;
-                    case '/':
-                        if (operandValue == 0) {
-                            cerr << "Error: Division by zero.\n";
-                            exit(EXIT_FAILURE);
-                        }
-                        result /= operandValue;
-                        break;
-                    case '\0': // Direct assignment or no operation specified
-                        result = operandValue;
-                        break;
-                    default:
-                        cerr << "Unrecognized operation: " << op.type << "\n";
-                        exit(EXIT_FAILURE);
-                }
+            // Then, expect to find the "->" symbol
+            // Followed by the destination variable
+            arrow = nextToken(line, pos);
+            result = nextToken(line, pos);
+
+            if (arrow != "->" || result.empty()) {
+                chunk.errors += "Error: Parsing unary operation failed.\n";
+                return true;
             }
+        }else {
+
+            // This section aims to remove outliers in the data
+            string_view restLine = restOfLine(line, pos);
+            size_t restPos = 0;
 
-            // Write the computed result to pipe
-            if (operationPipes.find(var) != operationPipes.end()) {
-                write(operationPipes[var].writeEnd, &result, sizeof(result));
-                close(operationPipes[var].writeEnd);
+            // Attempt to parse the arrow and result again from the rest of the line
+            arrow = nextToken(restLine, restPos);
+            result = nextToken(restLine, restPos);
+
+            if (arrow != "->" || result.empty()) {
+                chunk.errors += "Error: Expected '->' but found '";
+                chunk.errors.append(arrow).append("'\n");
+                return true;
             }
 
-            exit(EXIT_SUCCESS);
-        } else if (pid > 0) {
-            // We check if the current execution context is within the parent process
+            // If we reach this section, parsing was successful
+            firstVar = parser;
+            type = '\0'; // detects null operation
+        }
 
-            // We wait for child process to complete
-            waitpid(pid, NULL, 0);
+        // The operation is added to the graph, and printed, when the chunks are merged
+        uint32_t resultId = builder.intern(cleanName(result));
+        builder.addOperation(resultId, type, builder.intern(cleanName(firstVar)));
+    }
 
-            // We then read the pipe result to calculate any variables that depend on a pipe answer
-            if (operationPipes.find(var) != operationPipes.end()) {
-                int result;
-                int bytesRead = read(operationPipes[var].readEnd, &result, sizeof(result));
-                if (bytesRead > 0) {
+    return true;
+}
 
-                    variableValues[var] = result;
 
-                    cout << "Read result for " << var << ": " << result << endl;
+/* 
+    * The parseChunk() function parses every statement between begin and end
 
-                } else {
-                    cerr << "Failed to read result for " << var << "\n";
-                }
-                // Close the read-end of the pipe.
-                close(operationPipes[var].readEnd);
-            }
-        } else {
-            cerr << "Failed to fork for " << var << "\n";
-            return EXIT_FAILURE;
+    * The names found are then split into the given number of partitions by their hash,
+    so mergeChunks() can intern every partition on its own thread
+
+    * Variable begin must be the start of a statement, end the end of the text or just past a ';'
+
+*/
+void parseChunk(const char* begin, const char* end, size_t partitions, ParsedChunk& chunk) {
+    const char* pos = begin;
+    uint64_t statements = 0;
+    while (pos < end) {
+        const char* semicolon = static_cast<const char*>(memchr(pos, ';', end - pos));
+        const char* stop = semicolon != NULL ? semicolon : end;
+
+        statements++;
+        if (!parseStatement(string_view(pos, stop - pos), chunk)) {
+            break;
         }
+        pos = semicolon != NULL ? semicolon + 1 : end;
     }
 
+    // Only the id of each name is needed from here on
+    GraphBuilder& builder = chunk.builder;
+    unordered_map<string_view, uint32_t>().swap(builder.ids);
 
-    // Wait for child processes to finish
-    for (const auto& pid : childPids) {
-        int status;
-        waitpid(pid, &status, 0);
+    chunk.isResult.assign(builder.names.size(), false);
+    for (uint32_t id : builder.opResult) {
+        chunk.isResult[id] = true;
     }
+    chunk.partitions.resize(partitions);
+    hash<string_view> hashName;
+    for (uint32_t id = 0; id < builder.names.size(); id++) {
+        chunk.partitions[hashName(builder.names[id]) % partitions].push_back(id);
+    }
+    addMetric(STATEMENTS_PARSED, statements);
+}
 
-    // Read results from pipes
-    for (const auto& var : sortedVars) {
-        if (operationPipes.find(var) != operationPipes.end()) {
-            int result;
-            read(operationPipes[var].readEnd, &result, sizeof(result));
-        }
+
+/* 
+    * The runParallel() function runs task(0) up to task(count - 1), each on its own thread
+
+    * Task 0 runs on the calling thread, the function returns once every task is done
+
+*/
+template <typename Task>
+void runParallel(size_t count, const Task& task) {
+    vector<thread> workers;
+    for (size_t i = 1; i < count; i++) {
+        workers.emplace_back([&task, i]() { task(i); });
+    }
+    if (count > 0) {
+        task(0);
     }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
 
-    // Output results to the specified output file
-    ofstream outFile(outputName);
-    if (!outFile.is_open()) {
-        cerr << "Failed to open output file.\n";
-        return EXIT_FAILURE;
+
+/* 
+    * The mergeChunks() function merges the chunks of a graph file into one builder
+
+    * Every partition of names is interned on its own thread, numbering its names in file
+    order and sorting its result names. The partitions are then laid out one after the other,
+    and every chunk renumbers its operations into place on its own thread. Only the
+    declaration lists and the last merge of the sorted result names are left to one thread
+
+    * Variable chunks must all come before the write(...) statement, or be the chunk holding it
+
+*/
+void mergeChunks(const vector<ParsedChunk>& chunks, size_t partitions, GraphBuilder& builder) {
+    vector<vector<string_view> > partNames(partitions);
+    vector<vector<uint32_t> > partNodes(partitions); // result names, by number within the partition
+    vector<size_t> partBytes(partitions, 0);
+
+    // localIds maps the names of each chunk to their number within their partition
+    vector<vector<uint32_t> > localIds(chunks.size());
+    for (size_t c = 0; c < chunks.size(); c++) {
+        localIds[c].resize(chunks[c].builder.names.size());
+    }
+
+    runParallel(partitions, [&](size_t part) {
+        size_t expected = 0;
+        for (const auto& chunk : chunks) {
+            expected += chunk.partitions[part].size();
+        }
+        unordered_map<string_view, uint32_t> ids(expected);
+        vector<bool> isNode;
+        for (size_t c = 0; c < chunks.size(); c++) {
+            const ParsedChunk& chunk = chunks[c];
+            for (uint32_t id : chunk.partitions[part]) {
+                string_view name = chunk.builder.names[id];
+                auto found = ids.try_emplace(name, partNames[part].size());
+                if (found.second) {
+                    partNames[part].push_back(name);
+                    partBytes[part] += name.size();
+                    isNode.push_back(false);
+                }
+
+                uint32_t number = found.first->second;
+                localIds[c][id] = number;
+                if (chunk.isResult[id] && !isNode[number]) {
+                    isNode[number] = true;
+                    partNodes[part].push_back(number);
+                }
+            }
+        }
+
+        const vector<string_view>& names = partNames[part];
+        sort(partNodes[part].begin(), partNodes[part].end(), [&names](uint32_t first, uint32_t second) {
+            return names[first] < names[second];
+        });
+    });
+
+    // Partition p takes the ids from nameBase[p], chunk c writes its operations from opBase[c]
+    vector<uint32_t> nameBase(partitions + 1, 0), nodeBase(partitions + 1, 0);
+    for (size_t part = 0; part < partitions; part++) {
+        nameBase[part + 1] = nameBase[part] + partNames[part].size();
+        nodeBase[part + 1] = nodeBase[part] + partNodes[part].size();
+        builder.nameBytes += partBytes[part];
     }
-    for (const auto& var : writeVariables) {
+    vector<size_t> opBase(chunks.size() + 1, 0);
+    for (size_t c = 0; c < chunks.size(); c++) {
+        opBase[c + 1] = opBase[c] + chunks[c].builder.opResult.size();
+    }
+    builder.names.resize(nameBase[partitions]);
+    builder.nodeName.resize(nodeBase[partitions]);
+    builder.opResult.resize(opBase[chunks.size()]);
+    builder.opType.resize(opBase[chunks.size()]);
+    builder.opOperand.resize(opBase[chunks.size()]);
+
+    runParallel(partitions, [&](size_t i) {
+        copy(partNames[i].begin(), partNames[i].end(), builder.names.begin() + nameBase[i]);
+        for (size_t node = 0; node < partNodes[i].size(); node++) {
+            builder.nodeName[nodeBase[i] + node] = nameBase[i] + partNodes[i][node];
+        }
+        if (i >= chunks.size()) {
+            return;
+        }
 
-        if (find(inputVar.begin(), inputVar.end(), var) == inputVar.end()) {
-            outFile << var << " = " << variableValues[var] << "\n";
+        // The operations of chunk i keep their place in file order
+        const ParsedChunk& chunk = chunks[i];
+        vector<uint32_t>& ids = localIds[i];
+        for (size_t part = 0; part < partitions; part++) {
+            for (uint32_t id : chunk.partitions[part]) {
+                ids[id] += nameBase[part];
+            }
         }
+        const GraphBuilder& local = chunk.builder;
+        for (size_t op = 0; op < local.opResult.size(); op++) {
+            builder.opResult[opBase[i] + op] = ids[local.opResult[op]];
+            builder.opType[opBase[i] + op] = local.opType[op];
+            builder.opOperand[opBase[i] + op] = ids[local.opOperand[op]];
+        }
+    });
 
-        // If you want to output both the Graph Input Variables and Initialized Variables use:
-        /*
-        outFile << var << " = " << variableValues[var] << "\n";
-        */
+    for (size_t c = 0; c < chunks.size(); c++) {
+        for (uint32_t id : chunks[c].builder.inputs) {
+            builder.inputs.push_back(localIds[c][id]);
+        }
+        for (uint32_t id : chunks[c].builder.internals) {
+            builder.internals.push_back(localIds[c][id]);
+        }
+        for (uint32_t id : chunks[c].builder.writes) {
+            builder.writes.push_back(localIds[c][id]);
+        }
+    }
 
+    // The sorted result names of the partitions are merged pairwise, the pairs of a round in parallel
+    vector<uint32_t> merged(builder.nodeName.size());
+    auto byName = [&builder](uint32_t first, uint32_t second) {
+        return builder.names[first] < builder.names[second];
+    };
+    for (size_t width = 1; width < partitions; width *= 2) {
+        runParallel((partitions + 2 * width - 1) / (2 * width), [&](size_t pair) {
+            size_t first = pair * 2 * width;
+            size_t middle = min(first + width, partitions), last = min(first + 2 * width, partitions);
+            merge(builder.nodeName.begin() + nodeBase[first], builder.nodeName.begin() + nodeBase[middle],
+                  builder.nodeName.begin() + nodeBase[middle], builder.nodeName.begin() + nodeBase[last],
+                  merged.begin() + nodeBase[first], byName);
+        });
+        builder.nodeName.swap(merged);
     }
-    outFile.close();
+}
 
-    cout << "Computation complete. Results written to " << outputName << ".\n";
-    return 0;
+
+/* 
+    * The buildCompactGraph() function lays out the names and operations collected by a builder
+
+    * Result variables become nodes numbered in the sorted order of builder.nodeName, and the
+    operations of each node are stored next to each other in file order. Every array is sized
+    up front and taken from a single arena block
+
+    * Variable CompactGraph target receives the graph, replacing whatever it held
+
+*/
+void buildCompactGraph(const GraphBuilder& builder, CompactGraph& target) {
+    uint32_t nameCount = builder.names.size();
+    size_t opCount = builder.opResult.size();
+
+    // Nodes are the names that are the result of an operation
+    const vector<uint32_t>& nodeName = builder.nodeName;
+    vector<uint32_t> nameNode(nameCount, NO_NODE);
+    for (uint32_t node = 0; node < nodeName.size(); node++) {
+        nameNode[nodeName[node]] = node;
+    }
+    uint32_t nodeCount = nodeName.size();
+
+    // Everything is sized now, so the graph fits in one block
+    CompactGraph compact;
+    size_t words = (nameCount + 1) * 2 + builder.inputs.size() + builder.internals.size() + builder.writes.size()
+                 + nodeCount * 2 + 1 + opCount;
+    compact.arena.reserve(words * sizeof(uint32_t) + builder.nameBytes + nameCount + opCount + 16 * alignof(uint32_t));
+
+    char* names = compact.arena.allocateArray<char>(builder.nameBytes);
+    uint32_t* nameStart = compact.arena.allocateArray<uint32_t>(nameCount + 1);
+    nameStart[0] = 0;
+    for (uint32_t id = 0; id < nameCount; id++) {
+        memcpy(names + nameStart[id], builder.names[id].data(), builder.names[id].size());
+        nameStart[id + 1] = nameStart[id] + builder.names[id].size();
+    }
+
+    uint32_t* inputs = compact.arena.allocateArray<uint32_t>(builder.inputs.size());
+    copy(builder.inputs.begin(), builder.inputs.end(), inputs);
+    uint32_t* internals = compact.arena.allocateArray<uint32_t>(builder.internals.size());
+    copy(builder.internals.begin(), builder.internals.end(), internals);
+    uint32_t* writes = compact.arena.allocateArray<uint32_t>(builder.writes.size());
+    copy(builder.writes.begin(), builder.writes.end(), writes);
+
+    uint8_t* nameFlags = compact.arena.allocateArray<uint8_t>(nameCount);
+    memset(nameFlags, 0, nameCount);
+    for (uint32_t id : builder.inputs) {
+        nameFlags[id] |= NAME_INPUT;
+    }
+    for (uint32_t id : builder.internals) {
+        nameFlags[id] |= NAME_INTERNAL;
+    }
+    uint32_t* nameNodes = compact.arena.allocateArray<uint32_t>(nameCount);
+    copy(nameNode.begin(), nameNode.end(), nameNodes);
+    uint32_t* nodeNames = compact.arena.allocateArray<uint32_t>(nodeCount);
+    copy(nodeName.begin(), nodeName.end(), nodeNames);
+
+    // Counting sort by node keeps the operations of every node in file order
+    uint32_t* opStart = compact.arena.allocateArray<uint32_t>(nodeCount + 1);
+    memset(opStart, 0, (nodeCount + 1) * sizeof(uint32_t));
+    for (uint32_t id : builder.opResult) {
+        opStart[nameNode[id] + 1]++;
+    }
+    for (uint32_t node = 0; node < nodeCount; node++) {
+        opStart[node + 1] += opStart[node];
+    }
+
+    char* opType = compact.arena.allocateArray<char>(opCount);
+    uint32_t* opOperand = compact.arena.allocateArray<uint32_t>(opCount);
+    vector<uint32_t> next(opStart, opStart + nodeCount);
+    for (size_t i = 0; i < opCount; i++) {
+        uint32_t slot = next[nameNode[builder.opResult[i]]]++;
+        opType[slot] = builder.opType[i];
+        opOperand[slot] = builder.opOperand[i];
+    }
+
+    compact.nameCount = nameCount;
+    compact.names = names;
+    compact.nameStart = nameStart;
+    compact.nameFlags = nameFlags;
+    compact.nameNode = nameNodes;
+    compact.inputCount = builder.inputs.size();
+    compact.inputs = inputs;
+    compact.internalCount = builder.internals.size();
+    compact.internals = internals;
+    compact.writeCount = builder.writes.size();
+    compact.writes = writes;
+    compact.nodeCount = nodeCount;
+    compact.nodeName = nodeNames;
+    compact.opStart = opStart;
+    compact.opType = opType;
+    compact.opOperand = opOperand;
+
+    // The graph target held before is released in one go
+    target = move(compact);
+}
+
+
+/* 
+    * The printOperations() function prints the operations a chunk constructed
+
+    * The lines are formatted in a small buffer from the interned names, so a large graph
+    does not keep a second copy of itself as text
+
+*/
+void printOperations(const GraphBuilder& chunk) {
+    string buffer;
+    for (size_t op = 0; op < chunk.opResult.size(); op++) {
+        // Debugging print for the constructed operation
+        buffer += "Constructed operation: ";
+        if (chunk.opType[op] != '\0') {
+            buffer.append(1, chunk.opType[op]).append(" ");
+        }
+        buffer.append(chunk.names[chunk.opOperand[op]]).append(" -> ").append(chunk.names[chunk.opResult[op]]).append("\n");
+
+        if (buffer.size() >= 64 << 10) {
+            cout << buffer;
+            buffer.clear();
+        }
+    }
+    cout << buffer;
+}
+
+
+/* 
+    * The parseInput() function parses the input file to extract variables and operations for graph-based computation
+
+    * Builds a compact graph holding the input variables, internal variables, and operations
+
+    * Files of at least PARALLEL_PARSE_BYTES are split at ';' boundaries and the chunks are parsed
+    on options.parseThreads threads, then merged in file order by mergeChunks() on as many threads,
+    so every result variable keeps its operations in the order they were written. The parse log
+    is printed on a thread of its own meanwhile
+
+    * Variable string file_name contains the given dataflow graph, target receives the graph
+
+*/
+void parseInput(const string& file_name, CompactGraph& target) {
+    ifstream input(file_name, ios::binary);
+
+    if (!input.is_open()) {
+        throw runtime_error("Cannot open file: " + file_name);
+    }
+
+    // The file is read into a single buffer, every name is a view into it until the graph is built
+    string text;
+    input.seekg(0, ios::end);
+    if (input.tellg() > 0) {
+        text.reserve(input.tellg());
+    }
+    input.clear();
+    input.seekg(0);
+    char block[64 << 10];
+    while (input.read(block, sizeof(block)) || input.gcount() > 0) {
+        text.append(block, input.gcount());
+    }
+    input.close();
+
+    size_t threads = 1;
+    if (text.size() >= PARALLEL_PARSE_BYTES) {
+        threads = options.parseThreads > 0 ? options.parseThreads : max(1u, thread::hardware_concurrency());
+    }
+
+    // Chunk boundaries are moved forward to just past the next ';'
+    vector<size_t> bounds(1, 0);
+    for (size_t i = 1; i < threads; i++) {
+        size_t cut = max(bounds.back(), text.size() * i / threads);
+        size_t semicolon = text.find(';', cut);
+        if (semicolon == string::npos) {
+            break;
+        }
+        if (semicolon + 1 > bounds.back()) {
+            bounds.push_back(semicolon + 1);
+        }
+    }
+    bounds.push_back(text.size());
+
+    vector<ParsedChunk> chunks(bounds.size() - 1);
+    size_t partitions = chunks.size();
+    runParallel(chunks.size(), [&](size_t i) {
+        parseChunk(text.data() + bounds[i], text.data() + bounds[i + 1], partitions, chunks[i]);
+    });
+
+    // Everything after write(...) is ignored
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (chunks[i].sawWrite) {
+            chunks.resize(i + 1);
+            break;
+        }
+    }
+
+    // The parse log is printed in file order while the chunks are merged
+    thread printer([&chunks]() {
+        for (const auto& chunk : chunks) {
+            printOperations(chunk.builder);
+            cerr << chunk.errors;
+        }
+        cout.flush();
+    });
+
+    GraphBuilder builder;
+    mergeChunks(chunks, partitions, builder);
+    buildCompactGraph(builder, target);
+    printer.join();
+    addMetric(GRAPHS_PARSED);
+}
+
+
+/* 
+    * The commaMask functions find the commas in a 64 byte block of a values line
+
+    * Bit i of the returned mask is set when p[i] is a comma, the AVX2 and SSE2 versions
+    compare 32 or 16 bytes per instruction, the scalar one is used on other targets
+
+*/
+uint64_t commaMaskScalar(const char* p) {
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i++) {
+        mask |= (uint64_t)(p[i] == ',') << i;
+    }
+    return mask;
+}
+
+#ifdef HAVE_X86_SIMD
+uint64_t commaMaskSse2(const char* p) {
+    __m128i comma = _mm_set1_epi8(',');
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, comma)) << (16 * i);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+uint64_t commaMaskAvx2(const char* p) {
+    __m256i comma = _mm256_set1_epi8(',');
+    uint32_t low = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), comma));
+    uint32_t high = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), comma));
+    return low | ((uint64_t)high << 32);
+}
+#endif
+
+/* 
+    * The pickCommaMask() function picks the fastest commaMask function the CPU supports
+
+*/
+uint64_t (*pickCommaMask())(const char*) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return commaMaskAvx2;
+    }
+    return commaMaskSse2;
+#else
+    return commaMaskScalar;
+#endif
+}
+
+uint64_t (*commaMask)(const char*) = pickCommaMask();
+
+
+/* 
+    * The parseField() function converts one comma separated field to an integer
+
+    * Follows what cleanParser() and stoi() did with the field: leading spaces and ';' are
+    skipped, then whitespace, an optional sign and the digits, anything after the digits is
+    ignored. Runs of 8 digits are converted at once inside a 64-bit word
+
+    * Throws invalid_argument when there are no digits and out_of_range when the value
+    does not fit in an int, like stoi()
+
+*/
+int parseField(const char* pos, const char* end) {
+    while (pos < end && (*pos == ' ' || *pos == ';')) {
+        pos++;
+    }
+    while (pos < end && isspace((unsigned char)*pos)) {
+        pos++;
+    }
+
+    bool negative = false;
+    if (pos < end && (*pos == '-' || *pos == '+')) {
+        negative = *pos == '-';
+        pos++;
+    }
+    if (pos == end || (unsigned)(*pos - '0') > 9) {
+        throw invalid_argument("stoi");
+    }
+
+    // Capped just past the int range, so value * 100000000 stays far below INT64_MAX
+    // and a capped value is out of range with either sign
+    int64_t value = 0;
+    const int64_t overflow = (int64_t)INT_MAX + 2;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (end - pos >= 8) {
+        uint64_t chunk;
+        memcpy(&chunk, pos, sizeof(chunk));
+
+        // Every byte must be in '0'..'9' for the block to be converted at once
+        uint64_t high = chunk & 0xF0F0F0F0F0F0F0F0ULL;
+        uint64_t carry = (chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL;
+        if (high != 0x3030303030303030ULL || carry != 0x3030303030303030ULL) {
+            break;
+        }
+
+        chunk -= 0x3030303030303030ULL;
+        chunk = (chunk * 10) + (chunk >> 8);
+        chunk = (((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+               + (((chunk >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+
+        value = min(value * 100000000 + (int64_t)chunk, overflow);
+        pos += 8;
+    }
+#endif
+
+    while (pos < end && (unsigned)(*pos - '0') <= 9) {
+        value = min(value * 10 + (*pos - '0'), overflow);
+        pos++;
+    }
+
+    if (negative) {
+        value = -value;
+    }
+    if (value > INT_MAX || value < INT_MIN) {
+        throw out_of_range("stoi");
+    }
+    return (int)value;
+}
+
+
+/* 
+    * The parseValues() function splits one line of the values file into integers
+
+    * Commas are found 64 bytes at a time with commaMask(), the short tail with memchr()
+
+    * Fields are split like getline(',') splits them, so a trailing comma adds no field,
+    at most maxCount fields are converted
+
+    * Variable vector values receives the converted fields
+
+*/
+void parseValues(const char* begin, const char* end, size_t maxCount, vector<int>& values) {
+    const char* fieldStart = begin;
+    const char* block = begin;
+
+    while (values.size() < maxCount && end - block >= 64) {
+        uint64_t mask = commaMask(block);
+        while (mask != 0 && values.size() < maxCount) {
+            const char* comma = block + __builtin_ctzll(mask);
+            values.push_back(parseField(fieldStart, comma));
+            fieldStart = comma + 1;
+            mask &= mask - 1;
+        }
+        block += 64;
+    }
+
+    while (values.size() < maxCount && fieldStart < end) {
+        const char* comma = static_cast<const char*>(memchr(fieldStart, ',', end - fieldStart));
+        const char* stop = comma != NULL ? comma : end;
+        values.push_back(parseField(fieldStart, stop));
+        fieldStart = stop + 1;
+    }
+}
+
+
+/* 
+    * The parseValuesLegacy() function is the original getline(), cleanParser() and stoi() path
+
+    * Kept so --bench-values can compare parseValues() against it
+
+*/
+void parseValuesLegacy(const string& line, size_t maxCount, vector<int>& values) {
+    istringstream iss(line);
+    string value;
+
+    while (getline(iss, value, ',') && values.size() < maxCount) {
+        values.push_back(stoi(cleanParser(value)));
+    }
+}
+
+
+/* 
+    * The assignInputs() function assigns one line of initial values to the input variables
+
+    * Variable string line holds comma separated values in the same order as input_var
+
+*/
+void assignInputs(const string& line) {
+    PhaseTimer timer(PHASE_INIT);
+
+    // Reused between rows so a batch run does not allocate for every line
+    static vector<int> values;
+    values.clear();
+    parseValues(line.data(), line.data() + line.size(), graph.inputCount, values);
+
+    for (size_t i = 0; i < values.size(); i++) {
+        variableValues[graph.inputs[i]] = values[i];
+    }
+}
+
+
+/* 
+    * The initializeVars() function initializes given values needed to assign to the previous graph
+
+    * Reads in values from a file using IO, and assigns them to corresponding variables
+
+    * Variable string initialValue contains the given initialized values in a valid .txt file
+
+*/
+void initializeVars(const string& initialValue) {
+    ifstream file(initialValue);
+    if (!file.is_open()) {
+        throw runtime_error("Cannot open file: " + initialValue);
+    }
+
+    string line;
+    if (getline(file, line)) {
+        assignInputs(line);
+    } else {
+        cerr << "Error: Could not read the initial values line." << endl;
+    }
+    file.close();
+}
+
+
+/* 
+    * The fdBudget() function works out how many children the descriptor limit allows
+
+    * Every in-flight child holds one pipe read end in the parent, RESERVED_FDS are left
+    for stdio and files
+
+    * Return variable is the number of children RLIMIT_NOFILE allows, SIZE_MAX when unlimited
+
+*/
+size_t fdBudget() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return SIZE_MAX;
+    }
+
+    // One extra descriptor is needed for the write end while a child is being forked
+    size_t available = limit.rlim_cur;
+    return available > RESERVED_FDS + 1 ? available - RESERVED_FDS - 1 : 1;
+}
+
+
+/* 
+    * The defaultMaxProcs() function picks how many children may run at once
+
+    * Uses the CPU count, capped by fdBudget()
+
+    * Return variable is the cap, always at least 1
+
+*/
+size_t defaultMaxProcs() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t procs = cpus > 0 ? cpus : 1;
+    return max<size_t>(1, min(procs, fdBudget()));
+}
+
+
+/* 
+    * The sameOperations() function compares the operations of a node in two graphs
+
+    * Names are compared as text, since the same name can have different ids in each graph
+
+    * Return variable is true when both nodes apply the same operations in the same order
+
+*/
+bool sameOperations(const CompactGraph& first, uint32_t firstNode, const CompactGraph& second, uint32_t secondNode) {
+    uint32_t firstOp = first.opStart[firstNode], secondOp = second.opStart[secondNode];
+    if (first.opStart[firstNode + 1] - firstOp != second.opStart[secondNode + 1] - secondOp) {
+        return false;
+    }
+    for (; firstOp < first.opStart[firstNode + 1]; firstOp++, secondOp++) {
+        if (first.opType[firstOp] != second.opType[secondOp]
+            || first.nameView(first.opOperand[firstOp]) != second.nameView(second.opOperand[secondOp])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* 
+    * The buildPlan() function links the nodes of the graph to their dependencies
+
+    * Nodes are still started in sorted order. Whenever one node reads the result of another,
+    the one that sorts later waits for the one that sorts first, whichever of the two is the
+    reader. A later reader then sees the result read back from the earlier node, and an
+    earlier reader still sees the value from before the later node ran, so each child sees
+    the same values it would have seen when the graph ran one child at a time
+
+    * Return variable is the plan handed to executeGraph()
+
+*/
+ExecutionPlan buildPlan() {
+    ExecutionPlan plan;
+    uint32_t nodeCount = graph.nodeCount;
+
+    // Each edge runs from the earlier node in sorted order to the later one
+    vector<pair<uint32_t, uint32_t> > edges;
+    for (uint32_t node = 0; node < nodeCount; node++) {
+        plan.hasPipe.push_back((graph.nameFlags[graph.nodeName[node]] & NAME_INTERNAL) != 0);
+
+        for (uint32_t op = graph.opStart[node]; op < graph.opStart[node + 1]; op++) {
+            uint32_t other = graph.nameNode[graph.opOperand[op]];
+            if (other == NO_NODE || other == node) {
+                continue;
+            }
+            edges.push_back(make_pair(min(node, other), max(node, other)));
+        }
+    }
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+    plan.dependentStart.assign(nodeCount + 1, 0);
+    plan.pendingDeps.assign(nodeCount, 0);
+    for (const auto& edge : edges) {
+        plan.dependentStart[edge.first + 1]++;
+        plan.pendingDeps[edge.second]++;
+    }
+    for (uint32_t node = 0; node < nodeCount; node++) {
+        plan.dependentStart[node + 1] += plan.dependentStart[node];
+    }
+    for (const auto& edge : edges) {
+        plan.dependents.push_back(edge.second);
+    }
+
+    // The graph identity covers everything that decides the write(...) results
+    uint64_t identity = hashBytes(NULL, 0);
+    auto hashString = [&identity](const string& text) {
+        identity = hashBytes(text.c_str(), text.size() + 1, identity);
+    };
+    for (uint32_t i = 0; i < graph.inputCount; i++) {
+        hashString(graph.name(graph.inputs[i]));
+    }
+    hashString(";");
+    for (uint32_t i = 0; i < graph.internalCount; i++) {
+        hashString(graph.name(graph.internals[i]));
+    }
+    hashString(";");
+    for (uint32_t node = 0; node < nodeCount; node++) {
+        string result = graph.name(graph.nodeName[node]);
+        for (uint32_t op = graph.opStart[node]; op < graph.opStart[node + 1]; op++) {
+            identity = hashBytes(&graph.opType[op], sizeof(char), identity);
+            hashString(graph.name(graph.opOperand[op]));
+            hashString(result);
+        }
+    }
+    hashString(";");
+    for (uint32_t i = 0; i < graph.writeCount; i++) {
+        hashString(graph.name(graph.writes[i]));
+    }
+    plan.identity = identity;
+
+    return plan;
+}
+
+
+/* 
+    * The exitChild() function ends a forked child process
+
+    * Output is flushed and _exit() is called, so the static destructors never run in a child.
+    They would free the inherited result cache and graph and copy every page they touch
+
+*/
+[[noreturn]] void exitChild(int status) {
+    cout.flush();
+    cerr.flush();
+    fflush(NULL);
+    _exit(status);
+}
+
+
+/* 
+    * The runNode() function is run by a child process to compute one result variable
+
+    * Applies every operation of the variable in order and writes the result to the pipe
+
+    * Variable uint32_t node is the result variable, writeEnd is its pipe or -1 when no one reads it
+
+*/
+void runNode(uint32_t node, int writeEnd) {
+    int result = 0;
+
+    for (uint32_t op = graph.opStart[node]; op < graph.opStart[node + 1]; op++) {
+
+        //Reads the first variable to be operated on
+        int operandValue = variableValues[graph.opOperand[op]];
+
+        // Compute result based on operation type
+        switch (graph.opType[op]) {
+            case '+':
+                result += operandValue;
+                break;
+            case '-':
+                result -= operandValue;
+                break;
+            case '*':
+                result *= operandValue;
+                break;
+            case '/':
+                if (operandValue == 0) {
+                    cerr << "Error: Division by zero.\n";
+                    exitChild(EXIT_DIVISION_BY_ZERO);
+                }
+                result /= operandValue;
+                break;
+            case '\0': // Direct assignment or no operation specified
+                result = operandValue;
+                break;
+            default:
+                cerr << "Unrecognized operation: " << graph.opType[op] << "\n";
+                exitChild(EXIT_FAILURE);
+        }
+    }
+
+    // Write the computed result to pipe
+    if (writeEnd >= 0) {
+        write(writeEnd, &result, sizeof(result));
+        close(writeEnd);
+    }
+
+    exitChild(EXIT_SUCCESS);
+}
+
+
+/* 
+    * The executeGraph() function forks a child for every result variable in the plan
+
+    * At most maxProcs children are in flight, pipes are created right before a fork
+    and closed as soon as the result is read, so descriptors stay bounded on large graphs
+
+    * When fork() or pipe() hits a system limit the function waits for a running child
+    and retries instead of failing
+
+    * Variable size_t failures counts the children that did not exit successfully
+
+    * Return variable is false when a child could not be started at all
+
+*/
+bool executeGraph(const ExecutionPlan& plan, size_t maxProcs, size_t& failures) {
+    // The plan is reused for every batch row, so dependency counts are tracked on a copy
+    vector<uint32_t> pendingDeps = plan.pendingDeps;
+
+    // Ready variables come out in sorted order, like the sequential engine
+    priority_queue<uint32_t, vector<uint32_t>, greater<uint32_t> > ready;
+    for (uint32_t node = 0; node < graph.nodeCount; node++) {
+        if (pendingDeps[node] == 0) {
+            ready.push(node);
+        }
+    }
+
+    // Children in flight, keyed by pid
+    unordered_map<pid_t, RunningChild> running;
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+    while (!ready.empty() || !running.empty()) {
+
+        while (!ready.empty() && running.size() < maxProcs) {
+            uint32_t node = ready.top();
+            string var = graph.name(graph.nodeName[node]);
+
+            Pipe pipe;
+            if (plan.hasPipe[node] && !pipe.createPipe()) {
+                if ((errno == EMFILE || errno == ENFILE) && !running.empty()) {
+                    break; // Throttle until a running child frees its pipe
+                }
+                cerr << "Failed to create pipe for " << var << "\n";
+                return false;
+            }
+
+            cout << "Forking for variable: " << var << "\n";
+            cout.flush();
+            pid_t pid = fork();
+
+            if (pid == 0) { // Child process
+                pipe.closeReadEnd();
+                runNode(node, pipe.writeEnd);
+            } else if (pid < 0) {
+                int forkError = errno;
+                pipe.closeReadEnd();
+                pipe.closeWriteEnd();
+                if (forkError == EAGAIN && !running.empty()) {
+                    break; // Throttle until a running child exits
+                }
+                cerr << "Failed to fork for " << var << "\n";
+                return false;
+            }
+
+            // The parent only reads, the child holds the only write end
+            pipe.closeWriteEnd();
+            running[pid] = RunningChild{node, pipe.readEnd, chrono::steady_clock::now()};
+            ready.pop();
+            addMetric(FORKS);
+        }
+
+        // We wait for any child process to complete
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid failed");
+            return false;
+        }
+
+        auto child = running.find(pid);
+        if (child == running.end()) {
+            continue;
+        }
+        uint32_t node = child->second.node;
+        int readEnd = child->second.readEnd;
+        addMetric(WORKER_BUSY_NS, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - child->second.started).count());
+        running.erase(child);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            failures++;
+            addMetric(CHILD_FAILURES);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_DIVISION_BY_ZERO) {
+                addMetric(DIVISION_BY_ZERO);
+            }
+        } else {
+            addMetric(NODES_EVALUATED);
+        }
+
+        // We then read the pipe result to calculate any variables that depend on a pipe answer
+        if (readEnd >= 0) {
+            string var = graph.name(graph.nodeName[node]);
+            int result;
+            int bytesRead = read(readEnd, &result, sizeof(result));
+            if (bytesRead > 0) {
+
+                variableValues[graph.nodeName[node]] = result;
+                addMetric(PIPE_BYTES, bytesRead);
+
+                cout << "Read result for " << var << ": " << result << endl;
+
+            } else {
+                cerr << "Failed to read result for " << var << "\n";
+            }
+            // Close the read-end of the pipe.
+            close(readEnd);
+        }
+
+        for (uint32_t i = plan.dependentStart[node]; i < plan.dependentStart[node + 1]; i++) {
+            uint32_t dependent = plan.dependents[i];
+            if (--pendingDeps[dependent] == 0) {
+                ready.push(dependent);
+            }
+        }
+    }
+
+    // Utilization is busy time over the time maxProcs children could have been running
+    uint64_t elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+    addMetric(WORKER_CAPACITY_NS, elapsed * maxProcs);
+    return true;
+}
+
+
+/* 
+    * The evaluateGraph() function computes the graph for the current input values
+
+    * When the result cache is on, an input tuple that was computed before is answered
+    from the cache, a new tuple is executed and stored unless one of its children failed
+
+    * Return variable is false when the graph could not be executed
+
+*/
+bool evaluateGraph(const ExecutionPlan& plan, size_t maxProcs) {
+    PhaseTimer timer(PHASE_EXECUTE);
+    addMetric(ROWS_EVALUATED);
+
+    size_t failures = 0;
+    if (resultCache.capacity == 0) {
+        return executeGraph(plan, maxProcs, failures);
+    }
+
+    // Input variables without a value read as 0, exactly like in the children
+    vector<int> inputs;
+    for (uint32_t i = 0; i < graph.inputCount; i++) {
+        inputs.push_back(variableValues[graph.inputs[i]]);
+    }
+
+    // Only the computed write(...) variables are cached, input variables are never written
+    vector<uint32_t> outputs;
+    for (uint32_t i = 0; i < graph.writeCount; i++) {
+        if (!graph.isInput(graph.writes[i])) {
+            outputs.push_back(graph.writes[i]);
+        }
+    }
+
+    const CacheEntry* cached = resultCache.find(plan.identity, inputs);
+    if (cached != NULL) {
+        addMetric(CACHE_HITS);
+        for (size_t i = 0; i < outputs.size(); i++) {
+            variableValues[outputs[i]] = cached->results[i];
+        }
+        return true;
+    }
+    addMetric(CACHE_MISSES);
+
+    if (!executeGraph(plan, maxProcs, failures)) {
+        return false;
+    }
+
+    // Failed rows are run again next time so their errors are reported again
+    if (failures == 0) {
+        CacheEntry entry;
+        entry.graph = plan.identity;
+        entry.inputs = move(inputs);
+        for (uint32_t var : outputs) {
+            entry.results.push_back(variableValues[var]);
+        }
+        resultCache.insert(move(entry));
+    }
+    return true;
+}
+
+
+/* 
+    * The loadCache() function fills the result cache from a file written by saveCache()
+
+    * Entries of every graph are loaded, so switching back to an earlier graph still hits,
+    entries beyond the memory cap are dropped oldest first
+
+    * Counts are checked against the bytes left in the file, so a damaged file only loses
+    the entries from the first bad record on, it never stops the run
+
+    * Variable string path is the cache file, a missing file leaves the cache empty
+
+*/
+void loadCache(const string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        return;
+    }
+
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, "DFCACHE1", sizeof(magic)) != 0) {
+        cerr << "Warning: Ignoring unreadable cache file " << path << ".\n";
+        fclose(file);
+        return;
+    }
+
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0) {
+        cerr << "Warning: Ignoring unreadable cache file " << path << ".\n";
+        fclose(file);
+        return;
+    }
+    uint64_t remaining = info.st_size - sizeof(magic);
+
+    // Reads count ints once the file is known to hold them, and the count after them
+    auto readInts = [file, &remaining](vector<int>& values, uint32_t count) {
+        if (count > remaining / sizeof(int)) {
+            return false;
+        }
+        values.resize(count);
+        remaining -= count * sizeof(int);
+        return fread(values.data(), sizeof(int), count, file) == count;
+    };
+
+    // Entries are stored oldest first, so inserting them in order restores the recency
+    const size_t headerBytes = sizeof(uint64_t) + sizeof(uint32_t);
+    while (remaining > 0) {
+        CacheEntry entry;
+        uint32_t inputCount, resultCount;
+        bool readable = remaining >= headerBytes
+                     && fread(&entry.graph, sizeof(entry.graph), 1, file) == 1
+                     && fread(&inputCount, sizeof(inputCount), 1, file) == 1;
+        if (readable) {
+            remaining -= headerBytes;
+            readable = readInts(entry.inputs, inputCount) && remaining >= sizeof(resultCount)
+                    && fread(&resultCount, sizeof(resultCount), 1, file) == 1;
+        }
+        if (readable) {
+            remaining -= sizeof(resultCount);
+            readable = readInts(entry.results, resultCount);
+        }
+        if (!readable) {
+            cerr << "Warning: Ignoring unreadable cache file " << path << ".\n";
+            break;
+        }
+        resultCache.insert(move(entry));
+    }
+    fclose(file);
+}
+
+
+/* 
+    * The saveCache() function writes the result cache to disk for the next run
+
+    * The file is written to a temporary name and renamed into place
+
+    * Return variable is false when the cache could not be written
+
+*/
+bool saveCache(const string& path) {
+    string tempPath = path + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (file == NULL) {
+        perror("cache save failed");
+        return false;
+    }
+
+    bool written = fwrite("DFCACHE1", 1, 8, file) == 8;
+    for (auto it = resultCache.entries.rbegin(); written && it != resultCache.entries.rend(); ++it) {
+        uint32_t inputCount = it->inputs.size(), resultCount = it->results.size();
+        written = fwrite(&it->graph, sizeof(it->graph), 1, file) == 1
+               && fwrite(&inputCount, sizeof(inputCount), 1, file) == 1
+               && fwrite(it->inputs.data(), sizeof(int), inputCount, file) == inputCount
+               && fwrite(&resultCount, sizeof(resultCount), 1, file) == 1
+               && fwrite(it->results.data(), sizeof(int), resultCount, file) == resultCount;
+    }
+
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tempPath.c_str(), path.c_str()) != 0) {
+        perror("cache save failed");
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/* 
+    * The writeResults() function writes the computed write(...) variables
+
+    * Input variables are skipped, only the variables computed by the graph are written
+
+    * Variable ostream out is the output file
+
+*/
+void writeResults(ostream& out) {
+    PhaseTimer timer(PHASE_OUTPUT);
+    for (uint32_t i = 0; i < graph.writeCount; i++) {
+        uint32_t var = graph.writes[i];
+
+        if (!graph.isInput(var)) {
+            out << graph.name(var) << " = " << variableValues[var] << "\n";
+        }
+
+        // If you want to output both the Graph Input Variables and Initialized Variables use:
+        /*
+        out << graph.name(var) << " = " << variableValues[var] << "\n";
+        */
+
+    }
+}
+
+
+/* 
+    * The saveCheckpoint() function records the committed offsets of a batch run
+
+    * The checkpoint is written to a temporary file and renamed over the old one,
+    so a crash leaves either the previous or the new checkpoint, never half of one
+
+    * Return variable is false when the checkpoint could not be written
+
+*/
+bool saveCheckpoint(const string& path, const Checkpoint& checkpoint) {
+    string tempPath = path + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "w");
+    if (file == NULL) {
+        perror("checkpoint failed");
+        return false;
+    }
+
+    fprintf(file, "input_offset %lld\noutput_offset %lld\nrows %zu\ngraph %llu\nvalues_hash %llu\n",
+            checkpoint.inputOffset, checkpoint.outputOffset, checkpoint.rows,
+            (unsigned long long)checkpoint.graph, (unsigned long long)checkpoint.valuesHash);
+
+    bool written = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tempPath.c_str(), path.c_str()) != 0) {
+        perror("checkpoint failed");
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/* 
+    * The loadCheckpoint() function reads a checkpoint written by saveCheckpoint()
+
+    * Return variable is false when there is no complete checkpoint at path
+
+*/
+bool loadCheckpoint(const string& path, Checkpoint& checkpoint) {
+    ifstream file(path);
+    string inputKey, outputKey, rowsKey, graphKey, hashKey;
+
+    if (!(file >> inputKey >> checkpoint.inputOffset >> outputKey >> checkpoint.outputOffset >> rowsKey >> checkpoint.rows
+               >> graphKey >> checkpoint.graph >> hashKey >> checkpoint.valuesHash)) {
+        return false;
+    }
+    return inputKey == "input_offset" && outputKey == "output_offset" && rowsKey == "rows"
+        && graphKey == "graph" && hashKey == "values_hash";
+}
+
+
+/* 
+    * The hashValues() function hashes the first length bytes of the values file
+
+    * A checkpoint only fits the values it was written for, offsets into a file whose evaluated
+    part was edited would start in the middle of a line. Lines after the checkpoint may change,
+    so a bad row can be fixed before resuming
+
+    * Return variable is false when the file is shorter than length or cannot be read
+
+*/
+bool hashValues(const string& path, long long length, uint64_t& hash) {
+    ifstream file(path, ios::binary);
+    char block[64 << 10];
+    hash = hashBytes(NULL, 0);
+    while (length > 0 && file.read(block, min<long long>(length, sizeof(block)))) {
+        hash = hashBytes(block, file.gcount(), hash);
+        length -= file.gcount();
+    }
+    return length == 0;
+}
+
+
+/* 
+    * The assignRow() function assigns one line of a batch run, reporting a malformed line
+
+    * Variable long long offset is where the line starts in the values file, for the message
+
+    * Return variable is false when a value is not a number or does not fit in an int
+
+*/
+bool assignRow(const string& line, const string& initialValues, long long offset) {
+    try {
+        assignInputs(line);
+        return true;
+    } catch (const invalid_argument&) {
+        cerr << "Error: The line at byte " << offset << " of " << initialValues << " holds a value that is not a number.\n";
+    } catch (const out_of_range&) {
+        cerr << "Error: The line at byte " << offset << " of " << initialValues << " holds a value that does not fit in an int.\n";
+    }
+    return false;
+}
+
+
+/* 
+    * The syncOutput() function makes sure the rows written so far are on disk
+
+    * Variable ofstream outFile is flushed first, then the file is synced by name
+
+    * Return variable is false when the data could not be synced
+
+*/
+bool syncOutput(ofstream& outFile, const string& outputName) {
+    outFile.flush();
+    int fd = open(outputName.c_str(), O_WRONLY);
+    if (!outFile || fd < 0) {
+        perror("output sync failed");
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+
+/* 
+    * The runBatch() function evaluates the graph once for every line of the values file
+
+    * Each row's results are written to the output file followed by an empty line,
+    every options.checkpointEvery rows the committed offsets are saved to [output-file-name].ckpt
+
+    * With options.resume the run continues after the last checkpoint, rows past it are
+    evaluated again and the output is cut back to match, so the result is the same as
+    an uninterrupted run. A run that stopped before its first checkpoint starts again
+    from the first row, a checkpoint written for another graph or values file is refused
+
+    * A line that cannot be read as numbers ends the run with its byte offset reported. The
+    rows before it are kept and the last checkpoint stays in place, so the line can be fixed
+    and the run resumed
+
+    * Return variable is the exit status for main()
+
+*/
+int runBatch(const ExecutionPlan& plan, size_t maxProcs, const string& initialValues, const string& outputName) {
+    string checkpointPath = outputName + ".ckpt";
+    Checkpoint checkpoint;
+    checkpoint.graph = plan.identity;
+    checkpoint.valuesHash = hashBytes(NULL, 0);
+
+    bool resuming = options.resume && access(checkpointPath.c_str(), F_OK) == 0;
+    if (resuming) {
+        Checkpoint saved;
+        if (!loadCheckpoint(checkpointPath, saved)) {
+            cerr << "Error: Cannot read the checkpoint at " << checkpointPath << ".\n";
+            return EXIT_FAILURE;
+        }
+        if (saved.graph != checkpoint.graph) {
+            cerr << "Error: The graph changed since the checkpoint at " << checkpointPath << " was written.\n";
+            return EXIT_FAILURE;
+        }
+        uint64_t valuesHash;
+        if (!hashValues(initialValues, saved.inputOffset, valuesHash) || valuesHash != saved.valuesHash) {
+            cerr << "Error: " << initialValues << " changed since the checkpoint at " << checkpointPath << " was written.\n";
+            return EXIT_FAILURE;
+        }
+        if (truncate(outputName.c_str(), saved.outputOffset) != 0) {
+            perror("resume failed");
+            return EXIT_FAILURE;
+        }
+        checkpoint = saved;
+        cout << "Resuming after row " << checkpoint.rows << ".\n";
+    } else {
+        if (options.resume) {
+            cout << "No checkpoint at " << checkpointPath << ", starting from the first row.\n";
+        }
+        // A stale checkpoint must not be picked up by a later --resume of this run
+        unlink(checkpointPath.c_str());
+    }
+
+    ifstream values(initialValues);
+    if (!values.is_open()) {
+        throw runtime_error("Cannot open file: " + initialValues);
+    }
+    values.seekg(checkpoint.inputOffset);
+
+    ofstream outFile(outputName, resuming ? ios::app : ios::trunc);
+    if (!outFile.is_open()) {
+        cerr << "Failed to open output file.\n";
+        return EXIT_FAILURE;
+    }
+
+    string line;
+    size_t sinceCheckpoint = 0;
+    long long position = checkpoint.inputOffset;
+    while (getline(values, line)) {
+        long long lineStart = position;
+        position += line.size() + 1;
+
+        // The checkpoint covers every byte read so far, the newline included
+        checkpoint.valuesHash = hashBytes("\n", 1, hashBytes(line.data(), line.size(), checkpoint.valuesHash));
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            continue; // Blank lines carry no row
+        }
+
+        // Each row starts from its own inputs only
+        variableValues.assign(graph.nameCount, 0);
+        if (!assignRow(line, initialValues, lineStart)) {
+            outFile.close();
+            cerr << "Stopped after row " << checkpoint.rows << ", fix the line and run again with --resume.\n";
+            return EXIT_FAILURE;
+        }
+
+        if (!evaluateGraph(plan, maxProcs)) {
+            return EXIT_FAILURE;
+        }
+
+        writeResults(outFile);
+        outFile << "\n";
+        checkpoint.rows++;
+
+        // Nothing is left to resume once the last line has been read
+        if (++sinceCheckpoint >= options.checkpointEvery && !values.eof()) {
+            // Offsets are only recorded once the rows they cover are on disk
+            if (!syncOutput(outFile, outputName)) {
+                return EXIT_FAILURE;
+            }
+            checkpoint.inputOffset = values.tellg();
+            checkpoint.outputOffset = outFile.tellp();
+            saveCheckpoint(checkpointPath, checkpoint);
+            sinceCheckpoint = 0;
+        }
+    }
+    outFile.close();
+
+    // The run is complete, there is nothing left to resume
+    unlink(checkpointPath.c_str());
+
+    cout << "Computation complete. " << checkpoint.rows << " rows written to " << outputName << ".\n";
+    return 0;
+}
+
+
+/* 
+    * The collectMetrics() function adds up the metric slots of every thread
+
+    * Return variable is the totals at the time of the call
+
+*/
+MetricSnapshot collectMetrics() {
+    lock_guard<mutex> lock(metricsMutex);
+    MetricSnapshot snapshot = retiredMetrics;
+
+    for (const MetricSlot* slot : metricSlots) {
+        addSlot(snapshot, *slot);
+    }
+    return snapshot;
+}
+
+
+/* 
+    * The formatSeconds() function writes a nanosecond total as seconds
+
+    * The digits are produced from the integer, so large totals keep every nanosecond instead
+    of being cut to the six significant digits a double prints with by default
+
+    * Return variable is the seconds with nine decimals
+
+*/
+string formatSeconds(uint64_t ns) {
+    char text[32];
+    snprintf(text, sizeof(text), "%llu.%09llu", (unsigned long long)(ns / 1000000000), (unsigned long long)(ns % 1000000000));
+    return text;
+}
+
+
+/* 
+    * The formatMetrics() function renders the current metrics in Prometheus text format
+
+    * Return variable is the text served on the metrics socket and written to the metrics file
+
+*/
+string formatMetrics() {
+    static const char* const counterNames[COUNTER_COUNT][2] = {
+        {"engine_graphs_parsed_total", "Graph files parsed."},
+        {"engine_statements_parsed_total", "Graph statements parsed."},
+        {"engine_rows_evaluated_total", "Input rows evaluated, cache hits included."},
+        {"engine_nodes_evaluated_total", "Result variables computed successfully by a child."},
+        {"engine_forks_total", "Child processes forked."},
+        {"engine_pipe_bytes_total", "Result bytes read back from child pipes."},
+        {"engine_division_by_zero_total", "Children that stopped on a division by zero."},
+        {"engine_child_failures_total", "Children that did not exit successfully."},
+        {"engine_cache_hits_total", "Input rows answered from the result cache."},
+        {"engine_cache_misses_total", "Input rows not found in the result cache."},
+        {"engine_graph_reloads_total", "Graph files reloaded by --watch."},
+        {"engine_worker_busy_seconds_total", "Time children spent running."},
+        {"engine_worker_capacity_seconds_total", "Time children could have spent running, max procs times execute time."},
+    };
+    static const char* const phaseNames[PHASE_COUNT] = {"parse", "init", "execute", "output"};
+
+    MetricSnapshot snapshot = collectMetrics();
+    ostringstream out;
+
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        out << "# HELP " << counterNames[i][0] << " " << counterNames[i][1] << "\n";
+        out << "# TYPE " << counterNames[i][0] << " counter\n";
+        if (i == WORKER_BUSY_NS || i == WORKER_CAPACITY_NS) {
+            out << counterNames[i][0] << " " << formatSeconds(snapshot.counters[i]) << "\n";
+        } else {
+            out << counterNames[i][0] << " " << snapshot.counters[i] << "\n";
+        }
+    }
+
+    double capacity = snapshot.counters[WORKER_CAPACITY_NS];
+    ostringstream utilization;
+    utilization.precision(17);
+    utilization << (capacity > 0 ? snapshot.counters[WORKER_BUSY_NS] / capacity : 0);
+    out << "# HELP engine_worker_utilization Share of the child capacity that was in use.\n";
+    out << "# TYPE engine_worker_utilization gauge\n";
+    out << "engine_worker_utilization " << utilization.str() << "\n";
+
+    out << "# HELP engine_phase_duration_seconds Latency of the parse, init, execute and output phases.\n";
+    out << "# TYPE engine_phase_duration_seconds histogram\n";
+    for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+        uint64_t cumulative = 0;
+        for (size_t bucket = 0; bucket <= LATENCY_BUCKET_COUNT; bucket++) {
+            cumulative += snapshot.buckets[phase][bucket];
+            out << "engine_phase_duration_seconds_bucket{phase=\"" << phaseNames[phase] << "\",le=\"";
+            if (bucket < LATENCY_BUCKET_COUNT) {
+                out << LATENCY_BUCKETS[bucket];
+            } else {
+                out << "+Inf";
+            }
+            out << "\"} " << cumulative << "\n";
+        }
+        out << "engine_phase_duration_seconds_sum{phase=\"" << phaseNames[phase] << "\"} " << formatSeconds(snapshot.phaseNs[phase]) << "\n";
+        out << "engine_phase_duration_seconds_count{phase=\"" << phaseNames[phase] << "\"} " << cumulative << "\n";
+    }
+
+    return out.str();
+}
+
+
+/* 
+    * The saveMetrics() function writes the metrics to a file when the engine exits
+
+    * The file is written to a temporary name and renamed into place, so a scraper never reads half of it
+
+    * Return variable is false when the file could not be written
+
+*/
+bool saveMetrics(const string& path) {
+    string tempPath = path + ".tmp";
+    ofstream file(tempPath);
+    file << formatMetrics();
+    file.close();
+
+    if (!file || rename(tempPath.c_str(), path.c_str()) != 0) {
+        perror("metrics save failed");
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/* 
+    * The startMetricsServer() function serves the metrics on a Unix socket
+
+    * Every connection receives the current metrics and is closed, for example with
+    "socat - UNIX-CONNECT:[path]" or "curl --unix-socket [path] http://localhost/metrics"
+
+    * Variable thread server is set to the thread answering connections
+
+    * Return variable is the listening socket, or -1 when it could not be opened
+
+*/
+int startMetricsServer(const string& path, thread& server) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Error: Metrics socket path is too long.\n";
+        return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    // A socket left behind by an earlier run is replaced, any other file is left alone
+    struct stat info;
+    if (lstat(path.c_str(), &info) == 0) {
+        if (!S_ISSOCK(info.st_mode)) {
+            cerr << "Error: " << path << " exists and is not a socket.\n";
+            return -1;
+        }
+        unlink(path.c_str());
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || ::bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        perror("metrics socket failed");
+        if (listener >= 0) {
+            close(listener);
+        }
+        return -1;
+    }
+
+    server = thread([listener]() {
+        while (true) {
+            int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (client < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return; // The listener was shut down
+            }
+
+            // HTTP clients get a minimal response header, anything else gets the text only
+            string body = formatMetrics();
+            char request[1024];
+            struct timeval timeout = {0, 100000};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            ssize_t received = recv(client, request, sizeof(request), 0);
+            string reply = received >= 4 && memcmp(request, "GET ", 4) == 0
+                         ? "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n" + body
+                         : body;
+
+            for (size_t sent = 0; sent < reply.size(); ) {
+                ssize_t count = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+                if (count <= 0) {
+                    break;
+                }
+                sent += count;
+            }
+            close(client);
+        }
+    });
+    return listener;
+}
+
+
+/* 
+    * The stopMetricsServer() function closes the metrics socket and waits for its thread
+
+*/
+void stopMetricsServer(int listener, const string& path, thread& server) {
+    shutdown(listener, SHUT_RDWR);
+    server.join();
+    close(listener);
+    unlink(path.c_str());
+}
+
+
+/* 
+    * The runSingle() function evaluates the graph for the first line of the values file
+
+    * Return variable is the exit status for main()
+
+*/
+int runSingle(const ExecutionPlan& plan, size_t maxProcs, const string& initialValues, const string& outputName) {
+    // Assigns initial values such as "x, y, z" with given inputs
+    variableValues.assign(graph.nameCount, 0);
+    initializeVars(initialValues);
+
+    if (!evaluateGraph(plan, maxProcs)) {
+        return EXIT_FAILURE;
+    }
+
+    // Output results to the specified output file
+    ofstream outFile(outputName);
+    if (!outFile.is_open()) {
+        cerr << "Failed to open output file.\n";
+        return EXIT_FAILURE;
+    }
+    writeResults(outFile);
+    outFile.close();
+
+    cout << "Computation complete. Results written to " << outputName << ".\n";
+    return 0;
+}
+
+
+/* 
+    * The metricsSince() function returns what was recorded since an earlier snapshot
+
+*/
+MetricSnapshot metricsSince(const MetricSnapshot& before) {
+    MetricSnapshot now = collectMetrics();
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        now.counters[i] -= before.counters[i];
+    }
+    for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+        for (size_t bucket = 0; bucket <= LATENCY_BUCKET_COUNT; bucket++) {
+            now.buckets[phase][bucket] -= before.buckets[phase][bucket];
+        }
+        now.phaseNs[phase] -= before.phaseNs[phase];
+    }
+    return now;
+}
+
+
+/* 
+    * The mergeMetrics() function adds metrics recorded by another process to this thread
+
+*/
+void mergeMetrics(const MetricSnapshot& snapshot) {
+    MetricSlot& slot = localMetrics();
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        slot.counters[i].store(slot.counters[i].load(memory_order_relaxed) + snapshot.counters[i], memory_order_relaxed);
+    }
+    for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+        for (size_t bucket = 0; bucket <= LATENCY_BUCKET_COUNT; bucket++) {
+            atomic<uint64_t>& count = slot.buckets[phase][bucket];
+            count.store(count.load(memory_order_relaxed) + snapshot.buckets[phase][bucket], memory_order_relaxed);
+        }
+        slot.phaseNs[phase].store(slot.phaseNs[phase].load(memory_order_relaxed) + snapshot.phaseNs[phase], memory_order_relaxed);
+    }
+}
+
+
+/* 
+    * The runShard() function is run by a shard process to evaluate one range of the values file
+
+    * Variables begin and end are byte offsets of whole lines, rows are written to shardName
+
+    * Variable int reportEnd is the pipe the ShardReport is written to
+
+*/
+void runShard(const ExecutionPlan& plan, size_t maxProcs, const string& initialValues,
+              long long begin, long long end, const string& shardName, int reportEnd) {
+    MetricSnapshot before = collectMetrics();
+    size_t hits = resultCache.hits, misses = resultCache.misses;
+
+    ifstream values(initialValues);
+    ofstream outFile(shardName, ios::trunc);
+    if (!values.is_open() || !outFile.is_open()) {
+        cerr << "Failed to open files for shard " << shardName << "\n";
+        exitChild(EXIT_FAILURE);
+    }
+    values.seekg(begin);
+
+    string line;
+    long long position = begin;
+    uint64_t rows = 0;
+    while (position < end && getline(values, line)) {
+        long long lineStart = position;
+        position += line.size() + 1;
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            continue; // Blank lines carry no row
+        }
+
+        variableValues.assign(graph.nameCount, 0);
+        if (!assignRow(line, initialValues, lineStart)) {
+            exitChild(EXIT_FAILURE);
+        }
+        if (!evaluateGraph(plan, maxProcs)) {
+            exitChild(EXIT_FAILURE);
+        }
+
+        writeResults(outFile);
+        outFile << "\n";
+        rows++;
+    }
+
+    outFile.close();
+    if (!outFile) {
+        cerr << "Failed to write shard " << shardName << "\n";
+        exitChild(EXIT_FAILURE);
+    }
+
+    ShardReport report;
+    report.metrics = metricsSince(before);
+    report.cacheHits = resultCache.hits - hits;
+    report.cacheMisses = resultCache.misses - misses;
+    report.rows = rows;
+    write(reportEnd, &report, sizeof(report));
+    close(reportEnd);
+    exitChild(EXIT_SUCCESS);
+}
+
+
+/* 
+    * The runShardedBatch() function splits a batch run into options.shards row ranges
+
+    * Every range is evaluated by its own process, which shares the parsed plan with the parent
+    through fork(), and writes to [output-file-name].shard[N]. The shard files are joined in
+    range order, so the output is the same as a run with a single shard
+
+    * Children in flight are split evenly between the shards, checkpoints are not written
+
+    * The output file is only opened once every shard succeeded. When a shard cannot be started
+    or fails, the other shards are killed and reaped, their files are removed and the output
+    file is left as it was
+
+    * Return variable is the exit status for main()
+
+*/
+int runShardedBatch(const ExecutionPlan& plan, size_t maxProcs, const string& initialValues, const string& outputName) {
+    ifstream values(initialValues, ios::binary);
+    if (!values.is_open()) {
+        throw runtime_error("Cannot open file: " + initialValues);
+    }
+    values.seekg(0, ios::end);
+    long long size = values.tellg();
+
+    // Each cut is moved forward to the start of the next line
+    vector<long long> bounds(1, 0);
+    for (size_t i = 1; i < options.shards; i++) {
+        long long cut = max(bounds.back(), size * (long long)i / (long long)options.shards);
+        if (cut > 0) {
+            string rest;
+            values.clear();
+            values.seekg(cut - 1);
+            getline(values, rest);
+            cut = values.eof() ? size : (long long)values.tellg();
+        }
+        bounds.push_back(cut);
+    }
+    bounds.push_back(size);
+    values.close();
+
+    size_t shardProcs = max<size_t>(1, maxProcs / options.shards);
+    vector<pid_t> shardPids;
+    vector<int> reports;
+    vector<string> shardNames;
+
+    // Stops the shards started so far, SIGKILL since a shard may have the --watch SIGTERM handler
+    auto abandonShards = [&shardPids, &reports, &shardNames]() {
+        for (size_t i = 0; i < shardPids.size(); i++) {
+            kill(shardPids[i], SIGKILL);
+            close(reports[i]);
+            while (waitpid(shardPids[i], NULL, 0) < 0 && errno == EINTR) {
+            }
+        }
+        for (const auto& shardName : shardNames) {
+            unlink(shardName.c_str());
+        }
+        return EXIT_FAILURE;
+    };
+
+    for (size_t i = 0; i < options.shards; i++) {
+        shardNames.push_back(outputName + ".shard" + to_string(i));
+
+        Pipe pipe;
+        if (!pipe.createPipe()) {
+            cerr << "Failed to create pipe for shard " << i << "\n";
+            return abandonShards();
+        }
+
+        // Holding the metrics lock over fork() keeps the metrics thread from leaving it locked in the shard
+        cout.flush();
+        metricsMutex.lock();
+        pid_t pid = fork();
+        metricsMutex.unlock();
+
+        if (pid == 0) { // Shard process
+            pipe.closeReadEnd();
+            runShard(plan, shardProcs, initialValues, bounds[i], bounds[i + 1], shardNames[i], pipe.writeEnd);
+        } else if (pid < 0) {
+            cerr << "Failed to fork for shard " << i << "\n";
+            pipe.closeReadEnd();
+            pipe.closeWriteEnd();
+            return abandonShards();
+        }
+
+        pipe.closeWriteEnd();
+        shardPids.push_back(pid);
+        reports.push_back(pipe.readEnd);
+    }
+
+    // Shards report back in order, a shard that failed leaves its report empty
+    bool failed = false;
+    uint64_t rows = 0;
+    for (size_t i = 0; i < shardPids.size(); i++) {
+        if (failed) {
+            kill(shardPids[i], SIGKILL); // Their rows would be thrown away
+        }
+
+        ShardReport report;
+        size_t received = 0;
+        while (received < sizeof(report)) {
+            ssize_t count = read(reports[i], (char*)&report + received, sizeof(report) - received);
+            if (count <= 0) {
+                break;
+            }
+            received += count;
+        }
+        close(reports[i]);
+
+        int status;
+        while (waitpid(shardPids[i], &status, 0) < 0 && errno == EINTR) {
+        }
+
+        if (failed) {
+            continue;
+        }
+        if (received != sizeof(report) || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            cerr << "Shard " << i << " failed.\n";
+            failed = true;
+            continue;
+        }
+        mergeMetrics(report.metrics);
+        resultCache.hits += report.cacheHits;
+        resultCache.misses += report.cacheMisses;
+        rows += report.rows;
+    }
+
+    // The output file is only replaced when every shard succeeded
+    ofstream outFile;
+    if (!failed) {
+        outFile.open(outputName, ios::trunc | ios::binary);
+        if (!outFile.is_open()) {
+            cerr << "Failed to open output file.\n";
+            failed = true;
+        }
+    }
+
+    // The shard outputs are joined in input order
+    for (const auto& shardName : shardNames) {
+        if (!failed) {
+            ifstream shard(shardName, ios::binary);
+            if (shard.peek() != ifstream::traits_type::eof()) {
+                outFile << shard.rdbuf();
+            }
+        }
+        unlink(shardName.c_str());
+    }
+    if (!failed) {
+        outFile.close();
+        failed = !outFile;
+    }
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    cout << "Computation complete. " << rows << " rows written to " << outputName << " by " << options.shards << " shards.\n";
+    return 0;
+}
+
+
+/* 
+    * The runEvaluation() function evaluates the values file against the current plan
+
+    * Return variable is the exit status of runBatch() or runSingle()
+
+*/
+int runEvaluation(const ExecutionPlan& plan, size_t maxProcs, const string& initialValues, const string& outputName) {
+    int status;
+    if (options.batch && options.shards > 1) {
+        status = runShardedBatch(plan, maxProcs, initialValues, outputName);
+    } else if (options.batch) {
+        status = runBatch(plan, maxProcs, initialValues, outputName);
+    } else {
+        status = runSingle(plan, maxProcs, initialValues, outputName);
+    }
+
+    // Only the first run can continue an earlier one, later runs start over
+    options.resume = false;
+    return status;
+}
+
+
+/* 
+    * The reloadGraph() function parses the graph file again after it changed on disk
+
+    * The graph and its plan are rebuilt from scratch, which takes time linear in the file.
+    The new graph is compared with the current one node by node only to report what changed,
+    nothing of the old graph is reused. It replaces the current graph only once it is complete,
+    and it is called between evaluations, so no child is running on the old graph
+
+    * If the file cannot be read the current graph stays in place
+
+    * Return variable is true when the new graph differs from the current one
+
+*/
+bool reloadGraph(const string& dataFlow, ExecutionPlan& plan) {
+    PhaseTimer timer(PHASE_PARSE);
+
+    // The new graph is built next to the current one
+    CompactGraph next;
+    try {
+        parseInput(dataFlow, next);
+    } catch (const runtime_error& error) {
+        cerr << "Error: Reload failed, keeping the current graph. " << error.what() << "\n";
+        return false;
+    }
+
+    // Both node lists are sorted by name, so they are compared in one pass
+    size_t unchanged = 0, changed = 0, added = 0, removed = 0;
+    uint32_t oldNode = 0, newNode = 0;
+    while (oldNode < graph.nodeCount || newNode < next.nodeCount) {
+        int order = oldNode == graph.nodeCount ? 1 : newNode == next.nodeCount ? -1
+                  : graph.nameView(graph.nodeName[oldNode]).compare(next.nameView(next.nodeName[newNode]));
+        if (order < 0) {
+            removed++;
+            oldNode++;
+        } else if (order > 0) {
+            added++;
+            newNode++;
+        } else {
+            sameOperations(graph, oldNode++, next, newNode++) ? unchanged++ : changed++;
+        }
+    }
+
+    // No evaluation is running, so the old graph can be released here in one go
+    graph = move(next);
+    ExecutionPlan nextPlan = buildPlan();
+    addMetric(GRAPH_RELOADS);
+    cout << "Reloaded " << dataFlow << ": " << unchanged << " unchanged, " << changed << " changed, "
+         << added << " added, " << removed << " removed.\n";
+
+    bool differs = nextPlan.identity != plan.identity;
+    plan = move(nextPlan);
+    return differs;
+}
+
+
+/* 
+    * The requestStop() function is the SIGINT and SIGTERM handler of --watch
+
+*/
+void requestStop(int) {
+    stopRequested = 1;
+}
+
+
+/* 
+    * The waitForChange() function waits for the graph file to be written or replaced
+
+    * Events that follow within 100 ms are taken as part of the same save
+
+    * Variable string name is the file name inside the watched directory
+
+    * Return variable is 1 when the file changed, 0 when the wait ended without a change, for
+    example on a signal, and -1 when the watcher cannot be polled or read
+
+*/
+int waitForChange(int watcher, const string& name) {
+    bool changed = false;
+    int timeout = 500;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!stopRequested) {
+        struct pollfd poller = {watcher, POLLIN, 0};
+        int ready = poll(&poller, 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll failed");
+            return -1;
+        }
+        if (ready <= 0) {
+            if (changed) {
+                break;
+            }
+            continue;
+        }
+
+        ssize_t length = read(watcher, buffer, sizeof(buffer));
+        if (length < 0 && errno != EINTR) {
+            perror("read failed");
+            return -1;
+        }
+        for (ssize_t offset = 0; offset < length; ) {
+            const struct inotify_event* event = (const struct inotify_event*)(buffer + offset);
+            if (event->len > 0 && name == event->name) {
+                changed = true;
+                timeout = 100;
+            }
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed && !stopRequested ? 1 : 0;
+}
+
+
+/* 
+    * The watchGraph() function keeps the engine running and reloads the graph file when it changes
+
+    * The directory of the file is watched, so editors that save by replacing the file are seen too.
+    After every reload that changes the graph the values file is evaluated again
+
+    * Runs until SIGINT or SIGTERM, or until the watcher fails
+
+    * Return variable is the exit status of the last evaluation, EXIT_FAILURE when the watcher failed
+
+*/
+int watchGraph(const string& dataFlow, ExecutionPlan& plan, size_t maxProcs, const string& initialValues, const string& outputName) {
+    size_t slash = dataFlow.rfind('/');
+    string directory = slash == string::npos ? "." : (slash == 0 ? "/" : dataFlow.substr(0, slash));
+    string name = slash == string::npos ? dataFlow : dataFlow.substr(slash + 1);
+
+    int watcher = inotify_init1(IN_CLOEXEC);
+    if (watcher < 0 || inotify_add_watch(watcher, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("inotify failed");
+        if (watcher >= 0) {
+            close(watcher);
+        }
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    cout << "Watching " << dataFlow << " for changes.\n";
+    cout.flush();
+
+    int status = 0;
+    while (!stopRequested) {
+        int change = waitForChange(watcher, name);
+        if (change < 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (change > 0 && reloadGraph(dataFlow, plan)) {
+            status = runEvaluation(plan, maxProcs, initialValues, outputName);
+            cout.flush();
+        }
+    }
+
+    close(watcher);
+    return status;
+}
+
+
+/* 
+    * The heapBytes() function estimates what malloc hands out for a request, header included
+
+*/
+size_t heapBytes(size_t bytes) {
+    return bytes == 0 ? 0 : max<size_t>(32, (bytes + sizeof(size_t) + 15) & ~(size_t)15);
+}
+
+
+/* 
+    * The printMemoryReport() function prints the memory used by the parsed graph
+
+    * Compares the compact graph with an estimate of the earlier layout: an unordered_map of
+    operator vectors holding three strings each, string lists for the declarations and an
+    unordered_map of values by name. Strings of up to 15 characters are stored inline
+
+*/
+void printMemoryReport() {
+    auto stringHeap = [](size_t length) {
+        return length > 15 ? heapBytes(length + 1) : 0;
+    };
+    auto nameLength = [](uint32_t id) {
+        return (size_t)(graph.nameStart[id + 1] - graph.nameStart[id]);
+    };
+
+    // Operators held their type and three strings, secondVar was never used
+    const size_t operatorBytes = alignof(string) + 3 * sizeof(string);
+
+    size_t mapLayout = 0;
+    const uint32_t* lists[] = {graph.inputs, graph.internals, graph.writes};
+    uint32_t listCounts[] = {graph.inputCount, graph.internalCount, graph.writeCount};
+    for (int list = 0; list < 3; list++) {
+        mapLayout += heapBytes(listCounts[list] * sizeof(string));
+        for (uint32_t i = 0; i < listCounts[list]; i++) {
+            mapLayout += stringHeap(nameLength(lists[list][i]));
+        }
+    }
+
+    // operationsMap: bucket, hash node with key, and a vector of operators per result variable
+    for (uint32_t node = 0; node < graph.nodeCount; node++) {
+        size_t ops = graph.opStart[node + 1] - graph.opStart[node];
+        size_t capacity = 1;
+        while (capacity < ops) {
+            capacity *= 2;
+        }
+
+        mapLayout += sizeof(void*) + heapBytes(sizeof(void*) + sizeof(string) + sizeof(vector<char>) + sizeof(size_t));
+        mapLayout += stringHeap(nameLength(graph.nodeName[node])) + heapBytes(capacity * operatorBytes);
+        for (uint32_t op = graph.opStart[node]; op < graph.opStart[node + 1]; op++) {
+            mapLayout += stringHeap(nameLength(graph.opOperand[op])) + stringHeap(nameLength(graph.nodeName[node]));
+        }
+    }
+
+    // variableValues: bucket and hash node for every name
+    for (uint32_t id = 0; id < graph.nameCount; id++) {
+        mapLayout += sizeof(void*) + heapBytes(sizeof(void*) + sizeof(string) + sizeof(int) + sizeof(size_t)) + stringHeap(nameLength(id));
+    }
+
+    size_t compactLayout = graph.arena.reserved + graph.nameCount * sizeof(int);
+    size_t nodes = max<size_t>(graph.nodeCount, 1);
+
+    cout << "Memory report: " << graph.nodeCount << " nodes, " << graph.opStart[graph.nodeCount] << " operations, "
+         << graph.nameCount << " names\n";
+    cout << "  map layout (estimated): " << mapLayout << " bytes, " << mapLayout / nodes << " bytes per node\n";
+    cout << "  compact layout: " << compactLayout << " bytes, " << compactLayout / nodes << " bytes per node\n";
+}
+
+
+/* 
+    * The benchValues() function times the values tokenizers on every line of a values file
+
+    * Runs the original getline(), cleanParser() and stoi() path, parseValues() with the scalar
+    comma scan and parseValues() with the comma scan picked for this CPU, and checks they agree
+    on the values and on the lines they reject. A few edge cases, such as numbers far too
+    long for an int, are checked the same way before the file is timed
+
+    * Return variable is the exit status for main()
+
+*/
+int benchValues(const string& path) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        throw runtime_error("Cannot open file: " + path);
+    }
+
+    vector<string> lines;
+    string line;
+    size_t bytes = 0;
+    while (getline(file, line)) {
+        bytes += line.size() + 1;
+        lines.push_back(move(line));
+    }
+
+    uint64_t (*const picked)(const char*) = commaMask;
+    const char* names[] = {"getline + stoi", "scalar scan", "simd scan"};
+
+    // Reads one line with the tokenizer of the pass, the return value names the exception thrown
+    auto readLine = [](int pass, const string& text, vector<int>& values) -> char {
+        try {
+            if (pass == 0) {
+                parseValuesLegacy(text, SIZE_MAX, values);
+            } else {
+                parseValues(text.data(), text.data() + text.size(), SIZE_MAX, values);
+            }
+        } catch (const invalid_argument&) {
+            return 'i';
+        } catch (const out_of_range&) {
+            return 'o';
+        }
+        return '\0';
+    };
+
+    const string edgeCases[] = {
+        "10000000000000000000000000000000000000000000000000005", "-10000000000000000000000000000000000000000000000000005",
+        "2147483647", "2147483648", "-2147483648", "-2147483649", "99999999999999999999", "00000000000000000000000000000042",
+        " 12, +7 ,-0,1 2", "", ",", "abc", "-", "12345678,123456789,1234567890,12345678901"
+    };
+    for (const auto& text : edgeCases) {
+        vector<int> expected;
+        char expectedError = readLine(0, text, expected);
+        for (int pass = 1; pass < 3; pass++) {
+            commaMask = pass == 2 ? picked : commaMaskScalar;
+            vector<int> values;
+            if (readLine(pass, text, values) != expectedError || values != expected) {
+                cerr << "Error: " << names[pass] << " disagrees with getline + stoi on \"" << text << "\".\n";
+                commaMask = picked;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    vector<int> expected;
+    vector<pair<size_t, char> > expectedErrors;
+
+    for (int pass = 0; pass < 3; pass++) {
+        commaMask = pass == 2 ? picked : commaMaskScalar;
+        vector<int> values;
+        vector<pair<size_t, char> > errors; // line number and exception of every rejected line
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < lines.size(); i++) {
+            char error = readLine(pass, lines[i], values);
+            if (error != '\0') {
+                errors.push_back(make_pair(i + 1, error));
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (pass == 0) {
+            expected = values;
+            expectedErrors = errors;
+        } else if (values != expected || errors != expectedErrors) {
+            cerr << "Error: " << names[pass] << " disagrees with getline + stoi.\n";
+            commaMask = picked;
+            return EXIT_FAILURE;
+        }
+        cout << names[pass] << ": " << values.size() << " values in " << seconds << " s, "
+             << bytes / seconds / (1 << 20) << " MB/s";
+        if (!errors.empty()) {
+            cout << ", " << errors.size() << " lines rejected, first at line " << errors[0].first;
+        }
+        cout << "\n";
+    }
+    commaMask = picked;
+    return 0;
+}
+
+
+/* 
+    * The parseCount() function reads the positive number that follows a flag
+
+    * Return variable is false when text is not a positive number
+
+*/
+bool parseCount(const string& flag, const char* text, size_t& value) {
+    char* end;
+    long long parsed = strtoll(text, &end, 10);
+    if (*end != '\0' || parsed <= 0) {
+        cerr << "Error: " << flag << " needs a positive number.\n";
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+
+/* 
+    * The parseOptions() function reads the optional flags that follow the file arguments
+
+    * Variable int first is the index of the first flag in argv
+
+    * Return variable is false when a flag is unknown or missing its value
+
+*/
+bool parseOptions(int argc, char* argv[], int first) {
+    for (int i = first; i < argc; i++) {
+        string flag = argv[i];
+
+        if (flag == "--max-procs" && i + 1 < argc) {
+            if (!parseCount(flag, argv[++i], options.maxProcs)) {
+                return false;
+            }
+        } else if (flag == "--batch") {
+            options.batch = true;
+        } else if (flag == "--checkpoint-every" && i + 1 < argc) {
+            if (!parseCount(flag, argv[++i], options.checkpointEvery)) {
+                return false;
+            }
+        } else if (flag == "--resume") {
+            options.resume = true;
+        } else if (flag == "--cache-mb" && i + 1 < argc) {
+            size_t megabytes;
+            if (!parseCount(flag, argv[++i], megabytes)) {
+                return false;
+            }
+            options.cacheBytes = megabytes << 20;
+        } else if (flag == "--cache-file" && i + 1 < argc) {
+            options.cacheFile = argv[++i];
+        } else if (flag == "--metrics-file" && i + 1 < argc) {
+            options.metricsFile = argv[++i];
+        } else if (flag == "--metrics-socket" && i + 1 < argc) {
+            options.metricsSocket = argv[++i];
+        } else if (flag == "--shards" && i + 1 < argc) {
+            if (!parseCount(flag, argv[++i], options.shards)) {
+                return false;
+            }
+        } else if (flag == "--memory-report") {
+            options.memoryReport = true;
+        } else if (flag == "--watch") {
+            options.watch = true;
+        } else if (flag == "--parse-threads" && i + 1 < argc) {
+            if (!parseCount(flag, argv[++i], options.parseThreads)) {
+                return false;
+            }
+        } else {
+            cerr << "Error: Unknown option '" << flag << "'.\n";
+            return false;
+        }
+    }
+
+    if (options.resume && !options.batch) {
+        cerr << "Error: --resume only applies to --batch runs.\n";
+        return false;
+    }
+    if (options.shards > 1 && !options.batch) {
+        cerr << "Error: --shards only applies to --batch runs.\n";
+        return false;
+    }
+    if (options.shards > 1 && options.resume) {
+        cerr << "Error: --shards runs do not write checkpoints, so they cannot --resume.\n";
+        return false;
+    }
+
+    // A cache file on its own turns the cache on with a default cap
+    if (!options.cacheFile.empty() && options.cacheBytes == 0) {
+        options.cacheBytes = DEFAULT_CACHE_BYTES;
+    }
+    return true;
+}
+
+
+/* 
+     * Main function to orchestrate the execution of data flow operations.
+
+    * Reads input specifications, initializes variables, then forks child processes to execute operations
+    with a bounded number of children in flight.
+
+    * Results are read from pipes and written to an output file.
+
+    * Values are given on the command line, values may contain important input files or output file name
+
+*/
+int main(int argc, char* argv[]) {
+    if (argc == 3 && string(argv[1]) == "--bench-values") {
+        return benchValues(argv[2]);
+    }
+
+    if (argc < 4) {
+        cerr << "Usage: " << argv[0] << " [input-graph-file] [initial-values-file] [output-file-name]"
+             << " [--max-procs N] [--batch [--checkpoint-every N] [--resume] [--shards N]] [--cache-mb N] [--cache-file PATH]"
+             << " [--parse-threads N] [--metrics-file PATH] [--metrics-socket PATH] [--watch]"
+             << " [--memory-report]\n"
+             << "       " << argv[0] << " --bench-values [values-file]\n";
+        return 1;
+    }
+
+    // Extract file paths from arguments.
+    string dataFlow = argv[1], initialValues = argv[2], outputName = argv[3];
+
+    if (!parseOptions(argc, argv, 4)) {
+        return 1;
+    }
+
+    // The in-flight cap can never exceed what the descriptor limit allows
+    size_t maxProcs = options.maxProcs > 0 ? min(options.maxProcs, fdBudget()) : defaultMaxProcs();
+    if (options.maxProcs > maxProcs) {
+        cerr << "Warning: --max-procs lowered to " << maxProcs << " to fit RLIMIT_NOFILE.\n";
+    }
+
+    // Serves metrics for as long as the engine runs
+    int metricsServer = -1;
+    thread metricsThread;
+    if (!options.metricsSocket.empty()) {
+        metricsServer = startMetricsServer(options.metricsSocket, metricsThread);
+        if (metricsServer < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    ExecutionPlan plan;
+    {
+        PhaseTimer timer(PHASE_PARSE);
+
+        // Sets up operations and dependencies
+        parseInput(dataFlow, graph);
+
+        // Orders the variables starting from p0 and links the ones that depend on each other
+        plan = buildPlan();
+    }
+
+    if (options.memoryReport) {
+        printMemoryReport();
+    }
+
+    resultCache.capacity = options.cacheBytes;
+    if (!options.cacheFile.empty()) {
+        loadCache(options.cacheFile);
+    }
+
+    // Every line of the values file is its own evaluation
+    int status = runEvaluation(plan, maxProcs, initialValues, outputName);
+
+    // Long-lived runs keep the parsed graph, cache and metrics warm across graph edits
+    if (options.watch && status == 0) {
+        status = watchGraph(dataFlow, plan, maxProcs, initialValues, outputName);
+    }
+
+    if (resultCache.capacity > 0) {
+        cout << "Cache: " << resultCache.hits << " hits, " << resultCache.misses << " misses, "
+             << resultCache.entries.size() << " entries using " << resultCache.used << " bytes.\n";
+        if (!options.cacheFile.empty()) {
+            saveCache(options.cacheFile);
+        }
+    }
+
+    if (!options.metricsFile.empty()) {
+        saveMetrics(options.metricsFile);
+    }
+    if (metricsServer >= 0) {
+        stopMetricsServer(metricsServer, options.metricsSocket, metricsThread);
+    }
+    return status;
 }
\ No newline at end of file